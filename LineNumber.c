@@ -4,6 +4,14 @@
 * INPUT: 
 *     (OPTIONAL) STRING: The name of the file to output line-by-line,
 *                        with the line numbers prepended.  
+*     (OPTIONAL) --threads N: Number big regular files with N threads. The output
+*                is identical to the serial output.
+*     (OPTIONAL) --range N:M: Output only lines N through M (M may be left off to
+*                read to the end), still numbered from the start of the file.
+*     (OPTIONAL) --index: Build or refresh the line index of each file and exit.
+*     (OPTIONAL) --jobs N: Read and number up to N files at once (default 1).
+*     (OPTIONAL) --mem-budget=BYTES: Output --jobs may hold in memory ahead of the
+*                file being written (default 64M). K/M/G suffixes are accepted.
 * OUTPUT:
 *     File or STDIN content pre-pended by line numbers.
 *
@@ -11,66 +19,1188 @@
 *              given, treats each string as a file name and reads those files if they exist.
 *              Output is the keyboard input or file content, with each content line pre-
 *              pended by the line number.
+*              Input is read in large blocks and split into lines with memchr(), so
+*              lines of any length keep a single line number. Line bytes are copied
+*              straight into a fixed size output buffer that is flushed with write(),
+*              so memory use stays constant however much is piped in.
+*              With --threads, a big file is mapped and numbered in rounds of one
+*              chunk per thread. Threads count the newlines of their chunks, a
+*              prefix sum gives each chunk its first line number and output size,
+*              then each thread formats its chunk into a private buffer. Buffers
+*              are pwrite()n at their precomputed offsets when the output is a
+*              regular file, and written in order otherwise. The file must not
+*              change while it is being numbered: a chunk whose newline count
+*              differs between the passes, or that is cut short by truncation
+*              (SIGBUS on the mapping), stops the file with an error (ESTALE).
+*              A file that cannot be mapped is numbered serially instead.
+*              With --range, a sidecar index (NAME.lnidx) holding the byte offset of
+*              every INDEX_STRIDE'th line lets the read start at most INDEX_STRIDE
+*              lines before N. The index is rebuilt whenever the file's size or
+*              mtime no longer match the ones recorded in it.
+*              With --jobs, a pool of threads takes the files in argument order and
+*              numbers each one into its own list of output blocks. The main thread
+*              writes the blocks file by file in argument order. A thread that is
+*              not working on the file being written waits while the buffered
+*              blocks exceed the memory budget. Each file is numbered serially in
+*              this mode (--threads is not used).
+*              Build: gcc -O2 -pthread LineNumber.c -o LineNumber
 *********************************************************/
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-int main(int argc, char *argv[]){
-   char line[4096]; // buffer to hold the current line using POSIX suggested max size
-   int linenum = 1; // the current line number 
+#define IN_BUFSIZE (1 << 20) // Bytes requested from read() per call
+#define OUT_BUFSIZE (1 << 20) // Bytes of output collected before each write()
+#define THREAD_CHUNK (8 << 20) // Input bytes each thread numbers per round
+#define MIN_THREADED_SIZE (4 << 20) // Smaller files are numbered serially
+#define NUMBER_MAX_LEN 24 // Bytes format_number() writes at most
+#define MAX_THREADS 256
+#define INDEX_STRIDE 1024 // Lines between the offsets kept in a line index
+#define INDEX_SUFFIX ".lnidx"
+#define INDEX_MAGIC "LNIDX001"
+#define DEFAULT_MEM_BUDGET (64LL << 20) // Bytes --jobs may buffer ahead of the output
 
-   // Determine whether reading from a file or from STDIN
-   // If only the executable name was given on the command line then argc=1 so read from STDIN
-   if (argc == 1){
-      char *output = malloc(sizeof(char) * 1024); // allocate memory to hold the output
-      sprintf(output, "\n");
+/* How each file is to be numbered */
+struct line_opts {
+   int thread_cnt;       // threads for one big file
+   int range_flag;       // output only lines range_first through range_last
+   long long range_first;
+   long long range_last;
+};
 
-      // Read from STDIN until the user enters CTRL-D aka End of File (EOF)
-      while(!feof(stdin)) {
-         while( fgets(line, sizeof(line), stdin) != NULL){
-            sprintf(output, "%s%d\t%s", output, linenum, line);
+/* A block of one file's output waiting in a --jobs queue */
+struct out_block {
+   struct out_block *next;
+   size_t len;
+   char data[];
+};
+
+/* One file handled by the --jobs pool */
+struct file_job {
+   const char *name;
+   struct out_block *head; // output not yet written, oldest first
+   struct out_block *tail;
+   int done;   // the worker has queued all of the file's output
+   int opened; // the file was opened, so its output ends with a blank line
+   int error;  // errno of the failure to report after the output, or 0
+};
+
+/* Files shared by the --jobs worker threads and the main thread */
+struct file_pool {
+   pthread_mutex_t lock;
+   pthread_cond_t produced;  // a job gained a block or finished
+   pthread_cond_t consumed;  // blocks were written or the file being written moved on
+   struct file_job *jobs;
+   int job_cnt;
+   int next_job;             // next file for a worker to take
+   int writing;              // file whose blocks the main thread is writing
+   long long buffered;       // bytes queued across all jobs
+   long long budget;
+   const struct line_opts *opts;
+};
+
+/* Output collected in memory and handed to write() in large pieces. When pool is
+ * set, each flush queues the bytes on job instead of writing them. */
+struct out_buf {
+   int fd;
+   struct file_pool *pool;
+   int job;
+   size_t len;
+   char data[OUT_BUFSIZE];
+};
+
+/* Header of a line index sidecar. It is followed by entry_cnt byte offsets: entry
+ * j is where line j * stride + 1 starts. */
+struct line_index_header {
+   char magic[8];
+   long long stride;
+   long long file_size; // size and mtime of the file when it was indexed
+   long long mtime_ns;
+   long long entry_cnt;
+};
+
+/* One thread's share of a round of --threads numbering */
+struct chunk {
+   const char *data;     // first input byte of the chunk
+   size_t len;           // input bytes in the chunk
+   long long newlines;   // pass 1: newlines in the chunk
+   long long first_num;  // number of the first line that starts in the chunk
+   int at_line_start;    // the chunk starts at the beginning of a line
+   int ends_line;        // pass 1: the last byte of the chunk is a newline
+   char *out;            // pass 2: the numbered chunk
+   size_t out_len;       // exact size of the numbered chunk
+   int out_fd;           // pwrite the chunk here at out_off, or -1 to leave it in out
+   off_t out_off;
+   int error;            // errno from pwrite, ESTALE if the file changed, or 0
+};
+
+/* Where a chunk thread jumps back to if the mapped file is truncated under it.
+ * Set and cleared with signal fences around the accesses to the map, so the
+ * compiler cannot move them past those accesses or drop them. */
+static __thread sigjmp_buf *volatile chunk_jmp;
+
+/* Write len bytes to fd, retrying short writes. At a negative offset write() is
+ * used, otherwise pwrite(). Returns 0, or -1 with errno set. */
+static int write_all(int fd, const char *data, size_t len, off_t offset){
+   size_t done = 0;
+
+   while(done < len){
+      ssize_t nwritten = (offset < 0) ? write(fd, data + done, len - done)
+                                      : pwrite(fd, data + done, len - done, offset + done);
+
+      if(nwritten == -1){
+         if(errno == EINTR){
+            continue;
+         }
+         return(-1);
+      }
+      done += nwritten;
+   }
+
+   return(0);
+} // END OF write_all
+
+/* Queue a copy of the buffer on its --jobs file. Only the file being written may
+ * go over the memory budget, so the main thread can always make progress. */
+static void out_queue(struct out_buf *out){
+   struct file_pool *pool = out->pool;
+   struct file_job *job = &pool->jobs[out->job];
+   struct out_block *block = malloc(sizeof(struct out_block) + out->len);
+
+   if(block == NULL){
+      fprintf(stderr, "LineNumber: %s\n", strerror(errno));
+      exit(1);
+   }
+   block->next = NULL;
+   block->len = out->len;
+   memcpy(block->data, out->data, out->len);
+
+   pthread_mutex_lock(&pool->lock);
+   while(out->job != pool->writing && pool->buffered + (long long)out->len > pool->budget){
+      pthread_cond_wait(&pool->consumed, &pool->lock);
+   }
+   if(job->tail != NULL){
+      job->tail->next = block;
+   }
+   else{
+      job->head = block;
+   }
+   job->tail = block;
+   pool->buffered += out->len;
+   pthread_cond_broadcast(&pool->produced);
+   pthread_mutex_unlock(&pool->lock);
+
+   return;
+} // END OF out_queue
+
+/* Write everything in the buffer to its descriptor and empty it */
+static void out_flush(struct out_buf *out){
+   if(out->pool != NULL){
+      if(out->len > 0){
+         out_queue(out);
+      }
+      out->len = 0;
+      return;
+   }
+   if(write_all(out->fd, out->data, out->len, -1) == -1){
+      fprintf(stderr, "LineNumber: write: %s\n", strerror(errno));
+      exit(1);
+   }
+   out->len = 0;
+
+   return;
+} // END OF out_flush
+
+/* Append len bytes to the buffer, flushing whenever it fills */
+static void out_put(struct out_buf *out, const char *data, size_t len){
+   while(len > 0){
+      size_t room = OUT_BUFSIZE - out->len;
+      size_t take = (len < room) ? len : room;
+
+      memcpy(out->data + out->len, data, take);
+      out->len += take;
+      data += take;
+      len -= take;
+      if(out->len == OUT_BUFSIZE){
+         out_flush(out);
+      }
+   }
+
+   return;
+} // END OF out_put
+
+/* Write a line number and a tab at dst, formatting the digits by hand. Returns
+ * the number of bytes written. */
+static size_t format_number(char *dst, long long linenum){
+   char digits[24];
+   char *p = digits + sizeof(digits);
+
+   *--p = '\t';
+   do{
+      *--p = '0' + linenum % 10;
+      linenum /= 10;
+   }while(linenum > 0);
+
+   memcpy(dst, p, digits + sizeof(digits) - p);
+
+   return(digits + sizeof(digits) - p);
+} // END OF format_number
+
+/* Append a line number and a tab */
+static void out_number(struct out_buf *out, long long linenum){
+   char digits[24];
+
+   out_put(out, digits, format_number(digits, linenum));
+
+   return;
+} // END OF out_number
+
+/* Bytes taken by the prefixes of cnt lines numbered from first: the digits of
+ * every number plus one tab each */
+static long long prefix_bytes(long long first, long long cnt){
+   long long total = cnt;
+   long long width = 1;
+   long long limit = 10; // first number with width + 1 digits
+
+   while(limit <= first){
+      width++;
+      limit *= 10;
+   }
+   while(cnt > 0){
+      long long take = (cnt < limit - first) ? cnt : limit - first;
+
+      total += take * width;
+      first += take;
+      cnt -= take;
+      width++;
+      limit *= 10;
+   }
+
+   return(total);
+} // END OF prefix_bytes
+
+/* SIGBUS handler: a chunk thread touched a page of the map past the end of a
+ * file truncated since it was mapped. Anything else gets the default action. */
+static void chunk_sigbus(int sig){
+   if(chunk_jmp != NULL){
+      siglongjmp(*chunk_jmp, 1);
+   }
+   signal(sig, SIG_DFL);
+   raise(sig);
+} // END OF chunk_sigbus
+
+/* Pass 1 thread: count the newlines in one chunk */
+static void *count_chunk_thread(void *arg){
+   struct chunk *c = arg;
+   const char *p;
+   const char *end = c->data + c->len;
+   sigjmp_buf jmp;
+
+   c->error = 0;
+   if(sigsetjmp(jmp, 0) != 0){
+      chunk_jmp = NULL;
+      c->error = ESTALE;
+      return(NULL);
+   }
+   chunk_jmp = &jmp;
+   __atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+   p = c->data;
+   c->newlines = 0;
+   while( (p = memchr(p, '\n', end - p)) != NULL){
+      c->newlines++;
+      p++;
+   }
+   c->ends_line = (end[-1] == '\n');
+   __atomic_signal_fence(__ATOMIC_SEQ_CST);
+   chunk_jmp = NULL;
+
+   return(NULL);
+} // END OF count_chunk_thread
+
+/* Pass 2 thread: number one chunk into its private buffer (out_len bytes plus
+ * NUMBER_MAX_LEN of slack), and pwrite it when the output is a regular file. A
+ * chunk that no longer numbers to exactly out_len bytes has changed since pass 1. */
+static void *format_chunk_thread(void *arg){
+   struct chunk *c = arg;
+   const char *p;
+   const char *end = c->data + c->len;
+   long long linenum;
+   int at_line_start;
+   char *dst;
+   char *limit = c->out + c->out_len;
+   sigjmp_buf jmp;
+
+   c->error = 0;
+   if(sigsetjmp(jmp, 0) != 0){
+      chunk_jmp = NULL;
+      c->error = ESTALE;
+      return(NULL);
+   }
+   chunk_jmp = &jmp;
+   __atomic_signal_fence(__ATOMIC_SEQ_CST);
+   p = c->data;
+   linenum = c->first_num;
+   at_line_start = c->at_line_start;
+   dst = c->out;
+
+   while(p < end){
+      const char *nl = memchr(p, '\n', end - p);
+      const char *stop = (nl != NULL) ? nl + 1 : end;
+
+      if(at_line_start){
+         dst += format_number(dst, linenum); // may run into the slack
+         linenum++;
+      }
+      if(dst > limit || (size_t)(limit - dst) < (size_t)(stop - p)){
+         break;
+      }
+      memcpy(dst, p, stop - p);
+      dst += stop - p;
+      at_line_start = (nl != NULL);
+      p = stop;
+   }
+   __atomic_signal_fence(__ATOMIC_SEQ_CST);
+   chunk_jmp = NULL;
+   if(p < end || dst != limit){
+      c->error = ESTALE;
+      return(NULL);
+   }
+
+   if(c->out_fd != -1 && write_all(c->out_fd, c->out, c->out_len, c->out_off) == -1){
+      c->error = errno;
+   }
+
+   return(NULL);
+} // END OF format_chunk_thread
+
+/* Run fn on every chunk, one thread each. Returns 0, or -1 with errno set if a
+ * thread could not be started (the chunks already started are joined). */
+static int run_chunk_threads(struct chunk *chunks, int chunk_cnt, void *(*fn)(void *)){
+   pthread_t tids[MAX_THREADS];
+   int i;
+   int err = 0;
+
+   for(i=0; i<chunk_cnt; i++){
+      err = pthread_create(&tids[i], NULL, fn, &chunks[i]);
+      if(err != 0){
+         break;
+      }
+   }
+   while(i-- > 0){
+      pthread_join(tids[i], NULL);
+   }
+   if(err != 0){
+      errno = err;
+      return(-1);
+   }
+
+   return(0);
+} // END OF run_chunk_threads
+
+static int number_lines(int fd, char *buf, struct out_buf *out);
+
+/* Number a regular file of size bytes with thread_cnt threads. The output is the
+ * same as number_lines(). When stdout is a regular file (and not O_APPEND) each
+ * thread pwrite()s its chunk at the offset the prefix sum gave it; otherwise the
+ * chunks are written in order after each round. A file that cannot be mapped is
+ * numbered by number_lines() through buf. The file must not change meanwhile;
+ * if it does, numbering stops with errno ESTALE. Returns 0, or -1 with errno set. */
+static int number_lines_threaded(int fd, off_t size, int thread_cnt, char *buf, struct out_buf *out){
+   const char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+   struct chunk chunks[MAX_THREADS];
+   struct stat outstat;
+   struct sigaction sigbus_action;
+   struct sigaction old_sigbus_action;
+   off_t out_off = -1; // next output offset when chunks are pwrite()n
+   long long linenum = 1; // number of the next line to start
+   int prev_ends_line = 1; // the byte before the round is a newline (or there is none)
+   off_t pos = 0;
+   int ret = 0;
+   int i;
+
+   if(map == MAP_FAILED){
+      return(number_lines(fd, buf, out));
+   }
+   madvise((void *)map, size, MADV_SEQUENTIAL);
+
+   // A truncated file shows up as SIGBUS in the chunk threads
+   memset(&sigbus_action, 0, sizeof(sigbus_action));
+   sigbus_action.sa_handler = chunk_sigbus;
+   sigemptyset(&sigbus_action.sa_mask);
+   sigaction(SIGBUS, &sigbus_action, &old_sigbus_action);
+
+   out_flush(out);
+   if(fstat(out->fd, &outstat) == 0 && S_ISREG(outstat.st_mode) && !(fcntl(out->fd, F_GETFL) & O_APPEND)){
+      out_off = lseek(out->fd, 0, SEEK_CUR);
+   }
+
+   while(pos < size && ret == 0){
+      int chunk_cnt = 0;
+
+      // Cut the next round into one chunk per thread
+      while(chunk_cnt < thread_cnt && pos < size){
+         struct chunk *c = &chunks[chunk_cnt++];
+
+         c->data = map + pos;
+         c->len = (size - pos < THREAD_CHUNK) ? (size_t)(size - pos) : THREAD_CHUNK;
+         pos += c->len;
+      }
+
+      // Pass 1: newlines per chunk
+      if(run_chunk_threads(chunks, chunk_cnt, count_chunk_thread) == -1){
+         ret = -1;
+         break;
+      }
+      for(i=0; i<chunk_cnt; i++){
+         if(chunks[i].error){
+            errno = chunks[i].error;
+            ret = -1;
+         }
+      }
+      if(ret == -1){
+         break;
+      }
+
+      // Prefix sum: first line number and exact output size of every chunk.
+      // When a chunk ends in a newline, the next line starts in the next chunk.
+      for(i=0; i<chunk_cnt; i++){
+         struct chunk *c = &chunks[i];
+         long long starts;
+
+         c->at_line_start = (i == 0) ? prev_ends_line : chunks[i - 1].ends_line;
+         c->first_num = linenum;
+         starts = c->at_line_start + c->newlines - c->ends_line;
+         c->out_len = c->len + prefix_bytes(linenum, starts);
+         linenum += starts;
+         c->out_fd = (out_off >= 0) ? out->fd : -1;
+         c->out_off = out_off;
+         if(out_off >= 0){
+            out_off += c->out_len;
+         }
+         c->out = malloc(c->out_len + NUMBER_MAX_LEN);
+         if(c->out == NULL){
+            while(i-- > 0){
+               free(chunks[i].out);
+            }
+            ret = -1;
+            break;
+         }
+      }
+      if(ret == -1){
+         break;
+      }
+      prev_ends_line = chunks[chunk_cnt - 1].ends_line;
+
+      // Pass 2: format (and pwrite) every chunk
+      if(run_chunk_threads(chunks, chunk_cnt, format_chunk_thread) == -1){
+         ret = -1;
+      }
+      for(i=0; i<chunk_cnt; i++){
+         if(ret == 0 && chunks[i].error){
+            errno = chunks[i].error;
+            ret = -1;
+         }
+         if(ret == 0 && chunks[i].out_fd == -1 && write_all(out->fd, chunks[i].out, chunks[i].out_len, -1) == -1){
+            ret = -1;
+         }
+         free(chunks[i].out);
+      }
+   }
+
+   // Leave the file offset after the pwrite()n output so later writes follow it
+   if(out_off >= 0){
+      lseek(out->fd, out_off, SEEK_SET);
+   }
+   sigaction(SIGBUS, &old_sigbus_action, NULL);
+   munmap((void *)map, size);
+
+   return(ret);
+} // END OF number_lines_threaded
+
+/* Copy fd to the output with each line pre-pended by its line number. A line is
+ * numbered when its first byte is seen, so lines split across reads (or longer
+ * than the read buffer) keep one number. Returns 0, or -1 if a read failed. */
+static int number_lines(int fd, char *buf, struct out_buf *out){
+   long long linenum = 1; // the current line number
+   int at_line_start = 1; // the next byte starts a new line
+   ssize_t nread;
+
+   while( (nread = read(fd, buf, IN_BUFSIZE)) != 0){
+      char *p = buf;
+      char *end;
+
+      if(nread == -1){
+         if(errno == EINTR){
+            continue;
+         }
+         return(-1);
+      }
+      end = buf + nread;
+
+      while(p < end){
+         char *nl = memchr(p, '\n', end - p);
+         char *stop = (nl != NULL) ? nl + 1 : end;
+
+         if(at_line_start){
+            out_number(out, linenum);
+            linenum++;
+         }
+         out_put(out, p, stop - p);
+         at_line_start = (nl != NULL);
+         p = stop;
+      }
+   }
+
+   return(0);
+} // END OF number_lines
+
+/* Copy lines first through last of fd to the output, numbered, reading from the
+ * current offset, which must be the start of line linenum. Stops reading after
+ * line last. Returns 0, or -1 if a read failed. */
+static int number_range(int fd, char *buf, long long linenum, long long first, long long last, struct out_buf *out){
+   int at_line_start = 1; // the next byte starts line linenum
+   ssize_t nread;
+
+   while( (nread = read(fd, buf, IN_BUFSIZE)) != 0){
+      char *p = buf;
+      char *end;
+
+      if(nread == -1){
+         if(errno == EINTR){
+            continue;
+         }
+         return(-1);
+      }
+      end = buf + nread;
+
+      while(p < end){
+         char *nl = memchr(p, '\n', end - p);
+         char *stop = (nl != NULL) ? nl + 1 : end;
+
+         if(linenum > last){
+            return(0);
+         }
+         if(linenum >= first){
+            if(at_line_start){
+               out_number(out, linenum);
+            }
+            out_put(out, p, stop - p);
+         }
+         if(nl != NULL){
             linenum++;
          }
+         at_line_start = (nl != NULL);
+         p = stop;
+      }
+   }
+
+   return(0);
+} // END OF number_range
+
+/* Modification time of a stat result in nanoseconds */
+static long long mtime_ns(const struct stat *st){
+   return(st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec);
+} // END OF mtime_ns
+
+/* Build the line index of a regular file by scanning it. Returns a malloc()ed
+ * offset array and its length in *entry_cnt, or NULL with errno set. */
+static long long *build_line_index(int fd, char *buf, long long *entry_cnt){
+   long long cap = 1024;
+   long long *offsets = malloc(cap * sizeof(long long));
+   long long linenum = 1; // number of the next line to start
+   int at_line_start = 1;
+   off_t pos = 0;
+   ssize_t nread;
+
+   *entry_cnt = 0;
+   while(offsets != NULL && (nread = pread(fd, buf, IN_BUFSIZE, pos)) != 0){
+      char *p = buf;
+      char *end;
+
+      if(nread == -1){
+         if(errno == EINTR){
+            continue;
+         }
+         free(offsets);
+         return(NULL);
       }
-      printf("%s\n", output); 
+      end = buf + nread;
+
+      while(p < end){
+         char *nl = memchr(p, '\n', end - p);
+
+         if(at_line_start){
+            if((linenum - 1) % INDEX_STRIDE == 0){
+               if(*entry_cnt == cap){
+                  long long *grown = realloc(offsets, 2 * cap * sizeof(long long));
+
+                  if(grown == NULL){
+                     free(offsets);
+                     return(NULL);
+                  }
+                  offsets = grown;
+                  cap *= 2;
+               }
+               offsets[(*entry_cnt)++] = pos + (p - buf);
+            }
+            linenum++;
+         }
+         at_line_start = (nl != NULL);
+         p = (nl != NULL) ? nl + 1 : end;
+      }
+      pos += nread;
+   }
+
+   return(offsets);
+} // END OF build_line_index
+
+/* Write a line index next to the file, through a temporary file renamed into
+ * place so a reader never sees half an index. The temporary file gets a unique
+ * name from mkstemp(), so concurrent runs cannot clobber each other's and a
+ * planted symlink cannot redirect the write. Returns 0, or -1 with errno set. */
+static int save_line_index(const char *path, const struct line_index_header *hdr, const long long *offsets){
+   size_t path_len = strlen(path);
+   char *tmp_path = malloc(path_len + 8);
+   mode_t mask;
+   int fd;
+   int ret = 0;
+
+   if(tmp_path == NULL){
+      return(-1);
+   }
+   memcpy(tmp_path, path, path_len);
+   memcpy(tmp_path + path_len, ".XXXXXX", 8);
+
+   fd = mkstemp(tmp_path);
+   if(fd == -1){
+      free(tmp_path);
+      return(-1);
+   }
+   // mkstemp() creates the file 0600; give the index the usual 0644 less umask
+   mask = umask(0);
+   umask(mask);
+   if(fchmod(fd, 0644 & ~mask) == -1 ||
+      write_all(fd, (const char *)hdr, sizeof(*hdr), -1) == -1 ||
+      write_all(fd, (const char *)offsets, hdr->entry_cnt * sizeof(long long), -1) == -1){
+      ret = -1;
+   }
+   if(close(fd) == -1){
+      ret = -1;
+   }
+   if(ret == 0 && rename(tmp_path, path) == -1){
+      ret = -1;
+   }
+   if(ret == -1){
+      int err = errno;
+
+      unlink(tmp_path);
+      errno = err;
+   }
+   free(tmp_path);
+
+   return(ret);
+} // END OF save_line_index
+
+/* Read the header of the sidecar index at path. Returns its descriptor if the
+ * index matches the file's size and mtime, or -1 if it is missing or stale. */
+static int open_line_index(const char *path, const struct stat *filestat, struct line_index_header *hdr){
+   int fd = open(path, O_RDONLY);
+   struct stat idxstat;
+
+   if(fd == -1){
+      return(-1);
+   }
+   if(pread(fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr) || memcmp(hdr->magic, INDEX_MAGIC, 8) != 0 ||
+      hdr->stride != INDEX_STRIDE || hdr->file_size != filestat->st_size ||
+      hdr->mtime_ns != mtime_ns(filestat) || hdr->entry_cnt < 0 || fstat(fd, &idxstat) == -1 ||
+      idxstat.st_size != (off_t)(sizeof(*hdr) + hdr->entry_cnt * sizeof(long long))){
+      close(fd);
+      return(-1);
+   }
+
+   return(fd);
+} // END OF open_line_index
+
+/* Find where to start reading a regular file to reach line first: the offset of
+ * the closest indexed line at or before it, and that line's number. The sidecar
+ * index is used when it is current, and rebuilt (and saved, if the directory
+ * allows it) when it is not. With lookup 0 the index is only brought up to date.
+ * Returns 0, or -1 with errno set. */
+static int find_line_start(const char *filename, int fd, const struct stat *filestat, char *buf,
+                           long long first, off_t *offset, long long *linenum, int lookup){
+   char *path = malloc(strlen(filename) + sizeof(INDEX_SUFFIX));
+   struct line_index_header hdr;
+   long long entry = (first - 1) / INDEX_STRIDE;
+   long long start = 0;
+   int idx_fd;
+
+   if(path == NULL){
+      return(-1);
+   }
+   strcpy(path, filename);
+   strcat(path, INDEX_SUFFIX);
+
+   idx_fd = open_line_index(path, filestat, &hdr);
+   if(idx_fd != -1){
+      if(entry >= hdr.entry_cnt){
+         entry = hdr.entry_cnt - 1;
+      }
+      if(lookup && entry >= 0 &&
+         pread(idx_fd, &start, sizeof(start), sizeof(hdr) + entry * sizeof(long long)) != sizeof(start)){
+         close(idx_fd);
+         idx_fd = -1; // unreadable; fall through and rebuild it
+      }
+   }
+   if(idx_fd != -1){
+      close(idx_fd);
+   }
+   else{
+      long long *offsets = build_line_index(fd, buf, &hdr.entry_cnt);
+
+      if(offsets == NULL){
+         free(path);
+         return(-1);
+      }
+      memcpy(hdr.magic, INDEX_MAGIC, 8);
+      hdr.stride = INDEX_STRIDE;
+      hdr.file_size = filestat->st_size;
+      hdr.mtime_ns = mtime_ns(filestat);
+      if(save_line_index(path, &hdr, offsets) == -1 && !lookup){
+         // Only --index needs the sidecar itself; a lookup can use the array
+         int err = errno;
+
+         free(offsets);
+         free(path);
+         errno = err;
+         return(-1);
+      }
+      if(entry >= hdr.entry_cnt){
+         entry = hdr.entry_cnt - 1;
+      }
+      if(entry >= 0){
+         start = offsets[entry];
+      }
+      free(offsets);
+   }
+   free(path);
+
+   *offset = start;
+   *linenum = (entry >= 0) ? entry * INDEX_STRIDE + 1 : 1;
+
+   return(0);
+} // END OF find_line_start
+
+/* Number one open file into the output according to opts: a range, the whole
+ * file with threads, or the whole file serially. Returns 0, or -1 with errno set. */
+static int number_file(const char *filename, int fd, char *buf, struct out_buf *out, const struct line_opts *opts){
+   struct stat filestat;
+   int is_reg = (fstat(fd, &filestat) == 0 && S_ISREG(filestat.st_mode));
+   int ret = 0;
+
+   // A range of a regular file starts from the closest indexed line
+   if(opts->range_flag){
+      off_t offset = 0;
+      long long linenum = 1;
+
+      if(is_reg){
+         ret = find_line_start(filename, fd, &filestat, buf, opts->range_first, &offset, &linenum, 1);
+         if(ret == 0 && lseek(fd, offset, SEEK_SET) == -1){
+            ret = -1;
+         }
+      }
+      if(ret == 0){
+         ret = number_range(fd, buf, linenum, opts->range_first, opts->range_last, out);
+      }
+   }
+   // Big regular files can be split between threads
+   else if(opts->thread_cnt > 1 && is_reg && filestat.st_size >= MIN_THREADED_SIZE){
+      ret = number_lines_threaded(fd, filestat.st_size, opts->thread_cnt, buf, out);
+   }
+   else{
+      ret = number_lines(fd, buf, out);
+   }
+
+   return(ret);
+} // END OF number_file
+
+/* --jobs worker thread: take files in argument order and queue each one's output
+ * (header, numbered lines, blank line) on its job */
+static void *file_worker_thread(void *arg){
+   struct file_pool *pool = arg;
+   char *buf = malloc(IN_BUFSIZE);
+   struct out_buf *out = malloc(sizeof(struct out_buf));
+
+   if(buf == NULL || out == NULL){
+      fprintf(stderr, "LineNumber: %s\n", strerror(errno));
+      exit(1);
+   }
+   out->fd = -1;
+   out->pool = pool;
+   out->len = 0;
+
+   for(;;){
+      struct file_job *job;
+      int fd;
+
+      pthread_mutex_lock(&pool->lock);
+      out->job = pool->next_job++;
+      pthread_mutex_unlock(&pool->lock);
+      if(out->job >= pool->job_cnt){
+         break;
+      }
+      job = &pool->jobs[out->job];
+
+      out_put(out, "***** ", 6);
+      out_put(out, job->name, strlen(job->name));
+      out_put(out, " *****\n", 7);
+
+      fd = open(job->name, O_RDONLY);
+      if(fd == -1){
+         job->error = errno;
+      }
+      else{
+         job->opened = 1;
+         if(number_file(job->name, fd, buf, out, pool->opts) == -1){
+            // The main thread reports it, then writes the blank line
+            job->error = errno;
+         }
+         else{
+            out_put(out, "\n", 1);
+         }
+         close(fd);
+      }
+      out_flush(out);
+
+      pthread_mutex_lock(&pool->lock);
+      job->done = 1;
+      pthread_cond_broadcast(&pool->produced);
+      pthread_mutex_unlock(&pool->lock);
+   }
+   free(out);
+   free(buf);
+
+   return(NULL);
+} // END OF file_worker_thread
+
+/* Number the files with a pool of job_cnt threads, writing each file's output in
+ * argument order through out as soon as it is queued */
+static void number_files_pooled(char **filenames, int file_cnt, int job_cnt, long long budget,
+                                const struct line_opts *opts, struct out_buf *out){
+   struct file_pool pool;
+   struct line_opts serial = *opts;
+   pthread_t tids[MAX_THREADS];
+   int started;
+   int i;
+
+   serial.thread_cnt = 1;
+   pool.jobs = calloc(file_cnt, sizeof(struct file_job));
+   if(pool.jobs == NULL){
+      fprintf(stderr, "LineNumber: %s\n", strerror(errno));
+      exit(1);
+   }
+   for(i=0; i<file_cnt; i++){
+      pool.jobs[i].name = filenames[i];
+   }
+   pthread_mutex_init(&pool.lock, NULL);
+   pthread_cond_init(&pool.produced, NULL);
+   pthread_cond_init(&pool.consumed, NULL);
+   pool.job_cnt = file_cnt;
+   pool.next_job = 0;
+   pool.writing = 0;
+   pool.buffered = 0;
+   pool.budget = budget;
+   pool.opts = &serial;
+
+   if(job_cnt > file_cnt){
+      job_cnt = file_cnt;
+   }
+   for(started=0; started<job_cnt; started++){
+      if(pthread_create(&tids[started], NULL, file_worker_thread, &pool) != 0){
+         break;
+      }
+   }
+   if(started == 0){
+      fprintf(stderr, "LineNumber: could not start any threads\n");
+      exit(1);
+   }
+
+   // Write the files in argument order, each block as soon as it is queued
+   for(i=0; i<file_cnt; i++){
+      struct file_job *job = &pool.jobs[i];
+
+      pthread_mutex_lock(&pool.lock);
+      for(;;){
+         struct out_block *block;
+
+         while(job->head == NULL && !job->done){
+            pthread_cond_wait(&pool.produced, &pool.lock);
+         }
+         block = job->head;
+         if(block == NULL){
+            break;
+         }
+         job->head = block->next;
+         if(job->head == NULL){
+            job->tail = NULL;
+         }
+         pthread_mutex_unlock(&pool.lock);
+
+         out_put(out, block->data, block->len);
+
+         pthread_mutex_lock(&pool.lock);
+         pool.buffered -= block->len;
+         pthread_cond_broadcast(&pool.consumed);
+         free(block);
+      }
+      pool.writing = i + 1;
+      pthread_cond_broadcast(&pool.consumed);
+      pthread_mutex_unlock(&pool.lock);
+
+      if(job->error){
+         // Flush first so the message lands after the output it belongs to
+         out_flush(out);
+         fprintf(stderr, "LineNumber: %s: %s\n", job->name, strerror(job->error));
+         if(job->opened){
+            out_put(out, "\n", 1);
+         }
+      }
+   }
+
+   for(i=0; i<started; i++){
+      pthread_join(tids[i], NULL);
+   }
+   pthread_cond_destroy(&pool.consumed);
+   pthread_cond_destroy(&pool.produced);
+   pthread_mutex_destroy(&pool.lock);
+   free(pool.jobs);
+
+   return;
+} // END OF number_files_pooled
+
+/* Parse a byte count with an optional K, M, or G suffix. Returns -1 if invalid. */
+static long long parse_size(const char *str){
+   char *end;
+   long long size = strtoll(str, &end, 10);
+
+   if(end == str || size < 0){
+      return(-1);
+   }
+   switch(*end){
+      case 'K': case 'k':
+         size <<= 10;
+         end++;
+         break;
+      case 'M': case 'm':
+         size <<= 20;
+         end++;
+         break;
+      case 'G': case 'g':
+         size <<= 30;
+         end++;
+         break;
+   }
+
+   return(*end == '\0' ? size : -1);
+} // END OF parse_size
+
+/* Parse a --range value "N:M" or "N:". Returns 0, or -1 if it is invalid. */
+static int parse_range(const char *str, long long *first, long long *last){
+   char *end;
+
+   *first = strtoll(str, &end, 10);
+   if(end == str || *end != ':' || *first < 1){
+      return(-1);
+   }
+   str = end + 1;
+   if(*str == '\0'){
+      *last = LLONG_MAX;
+      return(0);
+   }
+   *last = strtoll(str, &end, 10);
+   if(*end != '\0' || *last < *first){
+      return(-1);
+   }
+
+   return(0);
+} // END OF parse_range
+
+int main(int argc, char *argv[]){
+   char *buf = malloc(IN_BUFSIZE); // input block being split into lines
+   struct out_buf *output = malloc(sizeof(struct out_buf)); // output waiting to be written
+   char **filenames = malloc(argc * sizeof(char *)); // the file name arguments, in order
+   int file_cnt = 0;
+   struct line_opts opts = {1, 0, 1, LLONG_MAX};
+   int job_cnt = 1;
+   long long mem_budget = DEFAULT_MEM_BUDGET;
+   int index_flag = 0;
+   int index;
+
+   if(buf == NULL || output == NULL || filenames == NULL){
+      fprintf(stderr, "LineNumber: %s\n", strerror(errno));
+      return(1);
+   }
+   output->fd = STDOUT_FILENO;
+   output->pool = NULL;
+   output->len = 0;
+
+   // Separate the options from the file names
+   // Note: index starts at 1 since argv[0] is the program name
+   for(index=1; index<argc; index++){
+      if(strcmp(argv[index], "--threads") == 0 || strncmp(argv[index], "--threads=", 10) == 0){
+         char *value = argv[index] + 9;
+
+         if(*value == '='){
+            value++;
+         }
+         else if(index + 1 < argc){
+            value = argv[++index];
+         }
+         opts.thread_cnt = atoi(value);
+         if(opts.thread_cnt < 1 || opts.thread_cnt > MAX_THREADS){
+            fprintf(stderr, "LineNumber: invalid number of threads: '%s'\n", value);
+            return(1);
+         }
+      }
+      else if(strcmp(argv[index], "--range") == 0 || strncmp(argv[index], "--range=", 8) == 0){
+         char *value = argv[index] + 7;
+
+         if(*value == '='){
+            value++;
+         }
+         else if(index + 1 < argc){
+            value = argv[++index];
+         }
+         if(parse_range(value, &opts.range_first, &opts.range_last) == -1){
+            fprintf(stderr, "LineNumber: invalid range: '%s' (expected N:M)\n", value);
+            return(1);
+         }
+         opts.range_flag = 1;
+      }
+      else if(strcmp(argv[index], "--jobs") == 0 || strncmp(argv[index], "--jobs=", 7) == 0){
+         char *value = argv[index] + 6;
+
+         if(*value == '='){
+            value++;
+         }
+         else if(index + 1 < argc){
+            value = argv[++index];
+         }
+         job_cnt = atoi(value);
+         if(job_cnt < 1 || job_cnt > MAX_THREADS){
+            fprintf(stderr, "LineNumber: invalid number of jobs: '%s'\n", value);
+            return(1);
+         }
+      }
+      else if(strncmp(argv[index], "--mem-budget=", 13) == 0){
+         mem_budget = parse_size(argv[index] + 13);
+         if(mem_budget < 0){
+            fprintf(stderr, "LineNumber: invalid memory budget: '%s'\n", argv[index] + 13);
+            return(1);
+         }
+      }
+      else if(strcmp(argv[index], "--index") == 0){
+         index_flag = 1;
+      }
+      else{
+         filenames[file_cnt++] = argv[index];
+      }
+   }
+
+   // Only bring the line indexes up to date
+   if(index_flag){
+      int ret = 0;
+
+      for(index=0; index<file_cnt; index++){
+         int fd = open(filenames[index], O_RDONLY);
+         struct stat filestat;
+         off_t offset;
+         long long linenum;
+
+         if(fd == -1){
+            fprintf(stderr, "LineNumber: %s: %s\n", filenames[index], strerror(errno));
+            ret = 1;
+            continue;
+         }
+         if(fstat(fd, &filestat) == -1 || !S_ISREG(filestat.st_mode)){
+            fprintf(stderr, "LineNumber: %s: not a regular file\n", filenames[index]);
+            ret = 1;
+         }
+         else if(find_line_start(filenames[index], fd, &filestat, buf, 1, &offset, &linenum, 0) == -1){
+            fprintf(stderr, "LineNumber: %s: %s\n", filenames[index], strerror(errno));
+            ret = 1;
+         }
+         close(fd);
+      }
+      free(filenames);
       free(output);
+      free(buf);
+
+      return(ret);
+   }
+
+   // Determine whether reading from a file or from STDIN
+   // If no file names were given on the command line then read from STDIN
+   if (file_cnt == 0){
+      out_put(output, "\n", 1);
+
+      // Read from STDIN until the user enters CTRL-D aka End of File (EOF)
+      if((opts.range_flag ? number_range(STDIN_FILENO, buf, 1, opts.range_first, opts.range_last, output)
+                     : number_lines(STDIN_FILENO, buf, output)) == -1){
+         out_flush(output);
+         fprintf(stderr, "LineNumber: read: %s\n", strerror(errno));
+      }
+      out_put(output, "\n", 1);
+   }
+   // Several files with --jobs are read concurrently and written in order
+   else if(job_cnt > 1 && file_cnt > 1){
+      number_files_pooled(filenames, file_cnt, job_cnt, mem_budget, &opts, output);
    }
-   // Else there are arguments so treat them as filenames and read from them if they exist
-   else if(argc > 1){
-      int index = 1; // index to loop through the file name arguments
+   // Else there are file names so read from them if they exist
+   else{
       char *filename; // use to point to the location in memory of the filenames
 
       // Loop through the file names
-      // Note: index starts at 1 since argv[0] is the program name
-      for(index=1; index<argc; index++) {
-         filename = argv[index];
-         printf("***** %s *****\n", filename);
+      for(index=0; index<file_cnt; index++) {
+         filename = filenames[index];
+         out_put(output, "***** ", 6);
+         out_put(output, filename, strlen(filename));
+         out_put(output, " *****\n", 7);
 
-         FILE *fp;
-         fp = fopen(filename, "r");
+         int fd = open(filename, O_RDONLY);
 
-         if(fp == NULL){
-            fprintf(stderr, "LineNumber: %s: %s\n", filename, strerror(perror));
+         if(fd == -1){
+            // Flush first so the message lands after the header it belongs to
+            out_flush(output);
+            fprintf(stderr, "LineNumber: %s: %s\n", filename, strerror(errno));
          }
-         // If the file open was successful, read the file line by line until EOF
-         // Output each line with a line number pre-pended 
+         // If the file open was successful, read the file block by block until EOF
+         // Output each line with a line number pre-pended; numbering restarts per file
          else{
-            while( fgets(line, sizeof(line), fp) ){
-               printf("%d\t%s", linenum, line); 
-               linenum++;
+            if(number_file(filename, fd, buf, output, &opts) == -1){
+               out_flush(output);
+               fprintf(stderr, "LineNumber: %s: %s\n", filename, strerror(errno));
             }
-            printf("\n");
-            // Reset the linenum back to 1
-            linenum = 1;
+            out_put(output, "\n", 1);
 
-            fclose(fp);
+            close(fd);
          }
       }
    }
-   else{
-      printf("ERROR: argc < 1");
-   }
+   out_flush(output);
+   free(filenames);
+   free(output);
+   free(buf);
+
    return(0);
 }
 
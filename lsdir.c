@@ -3,91 +3,2297 @@
 *
 * INPUT: 
 *     (OPTIONAL) STRING: The directory that should have its subdirs listed. 
+*     (OPTIONAL) -L: Follow symlinks to directories. Each directory is still listed
+*                only once, so links that loop back are not walked again.
+*     (OPTIONAL) -x: Stay on the filesystem of the directory given; mount points are
+*                output but not descended into.
+*     (OPTIONAL) --maxdepth N: Do not go more than N levels below the directory given
+*                (its subdirectories are level 1).
+*     (OPTIONAL) --mindepth N: Do not output directories less than N levels down;
+*                they are still walked.
+*     (OPTIONAL) --exclude GLOB: Leave out matching directories and everything under
+*                them. A GLOB without '/' is matched against the directory name,
+*                one with '/' against its path below the directory given. May be
+*                repeated.
+*     (OPTIONAL) --prune-name GLOB: Output directories whose name matches but do not
+*                descend into them. May be repeated.
+*     (OPTIONAL) -j N: List directories with N threads. Output order then depends on
+*                thread timing unless --sorted is given.
+*     (OPTIONAL) --sorted: Output the tree depth first with the subdirectories of
+*                each directory sorted by name, so runs can be diffed. Cannot be
+*                combined with -L.
+*     (OPTIONAL) --dirbuf=BYTES: Size of the buffer directory entries are read into
+*                (default 1M). K and M suffixes are accepted.
+*     (OPTIONAL) --snapshot=FILE: Keep a snapshot of the tree in FILE and, on the
+*                next run, only read directories whose mtime changed since.
+*     (OPTIONAL) --watch: After the listing, keep running and print a line for every
+*                subdirectory created, removed or renamed in the tree:
+*                   created: PATH     removed: PATH     renamed: OLD -> NEW
 *
 * OUTPUT: The subdirectories of the given or current working directory. 
 *
 * DESCRIPTION: Recursively lists all subdirectories for the specified directory. 
 *              If no directory is specified, the current directory is used.
+*              Directories are read with raw getdents64() calls and walked on a
+*              stack kept on the heap, so neither huge directories nor deep trees
+*              are a problem.
+*              Build: gcc -O2 -pthread lsdir.c -o lsdir
 *               
 *********************************************************/
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
-/* ARG dirname: the full or relative path directory name whose subdirectories should be output */
-void list_directories(char *dirname){
-   DIR *startdir_ptr;
-   struct dirent *currentdir_ptr;
+#define MAX_JOBS 256
+#define THREAD_OUT_BUFSIZE (64 * 1024) // Bytes of names a thread collects before writing
+#define DEFAULT_DIRBUF_SIZE (1 << 20) // Bytes of directory entries read per getdents64()
+#define MIN_DIRBUF_SIZE 4096 // Room for at least one entry with the longest name
+#define MAX_OPEN_DIRS 256 // Directory descriptors a serial walk keeps open at most
+
+#define GLOB_LITERAL 0 // a run of literal text
+#define GLOB_ANY 1     // ?
+#define GLOB_STAR 2    // *
+#define GLOB_CLASS 3   // [...]
+
+/* One piece of a compiled glob */
+struct glob_token {
+   int type;
+   size_t len;            // GLOB_LITERAL: bytes of text
+   const char *text;      // GLOB_LITERAL: the text, unescaped
+   unsigned char set[32]; // GLOB_CLASS: one bit per byte that matches
+};
+
+/* A glob compiled once at startup into runs of literal text, which are compared
+ * with memcmp() when it is matched */
+struct glob {
+   struct glob_token *tokens;
+   int token_cnt;
+   int is_path; // has a '/', so it is matched against the path and not the name
+   char *text;  // literal text the tokens point into
+};
+
+/* How to walk the tree */
+struct walk_opts {
+   int follow;   // -L: follow symlinks to directories
+   int one_fs;   // -x: do not descend into other filesystems
+   int maxdepth; // deepest level to output; subdirectories of the given one are level 1
+   int mindepth; // shallowest level to output
+   struct glob *excludes;
+   int exclude_cnt;
+   int path_exclude_cnt; // how many of the excludes are matched against paths
+   struct glob *prunes;
+   int prune_cnt;
+};
+
+#define WALK_SHOW 1    // output the directory
+#define WALK_DESCEND 2 // walk the directories under it
+
+/* A directory already walked, by device and inode */
+struct visited_slot {
+   dev_t dev;
+   ino_t ino;
+   int state; // VISIT_EMPTY, VISIT_OPEN while its subtree is walked, then VISIT_DONE
+};
+
+#define VISIT_EMPTY 0
+#define VISIT_OPEN 1
+#define VISIT_DONE 2
+
+/* Open addressing hash set of the directories walked, by device and inode. A
+ * directory reached again through a link or a bind mount is output but not walked
+ * twice, and one still being walked further up is a filesystem loop. */
+struct visited_set {
+   struct visited_slot *slots;
+   size_t cap; // a power of two
+   size_t cnt;
+};
+
+/* A directory entry as returned by getdents64() */
+struct linux_dirent64 {
+   uint64_t d_ino; // fixed by the kernel ABI, whatever ino_t and off_t are here
+   int64_t d_off;
+   unsigned short d_reclen;
+   unsigned char d_type;
+   char d_name[];
+};
+
+/* Reads the entries of one directory at a time through a reusable buffer filled by
+ * raw getdents64() calls, so a directory with millions of entries takes few system
+ * calls */
+struct dir_reader {
+   int fd;
+   int error;  // errno of a failed getdents64(), or 0
+   char *buf;
+   size_t cap;
+   size_t len; // bytes returned by the last getdents64()
+   size_t pos; // offset of the next entry in buf
+};
+
+#define SNAPSHOT_MAGIC "LSDIRSNP"
+#define SNAPSHOT_VERSION 2
+
+/* Header of a snapshot file. It is followed by dir_cnt snap_dir records sorted by
+ * device and inode, child_cnt snap_child records, and names_len bytes of names. */
+struct snap_header {
+   char magic[8];
+   long long version;
+   long long dir_cnt;
+   long long child_cnt;
+   long long names_len;
+   long long taken_ns; // when the run that wrote it started reading directories
+};
+
+/* One directory in a snapshot */
+struct snap_dir {
+   unsigned long long dev;
+   unsigned long long ino;
+   long long mtime_ns;
+   long long first_child; // its entries are children[first_child, first_child + child_cnt)
+   long long child_cnt;
+};
+
+/* One entry of a directory in a snapshot: a subdirectory, or a symlink whose
+ * target has to be checked again on every run */
+struct snap_child {
+   long long name_off; // offset of the name in the names area
+   long long is_link;
+};
+
+/* The snapshot from the last run (mapped) and the one being built by this run */
+struct snapshot {
+   void *map;
+   size_t map_len;
+   const struct snap_dir *dirs;
+   const struct snap_child *children;
+   const char *names;
+   long long dir_cnt;
+   long long trusted_ns; // records with an mtime before this can be reused
+
+   long long taken_ns;
+
+   struct snap_dir *new_dirs;
+   long long new_dir_cnt;
+   long long new_dir_cap;
+   struct snap_child *new_children;
+   long long new_child_cnt;
+   long long new_child_cap;
+   char *new_names;
+   long long new_names_len;
+   long long new_names_cap;
+};
+
+/* Names of the subdirectories found in one directory, packed with their NULs */
+struct name_list {
+   char *data;
+   size_t len;
+   size_t cap;
+};
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+#define WATCH_BUFSIZE (64 * 1024) // Bytes of inotify events read at a time
+#define MOVE_PAIR_WAIT_MS 10 // How long to wait for the IN_MOVED_TO half of a rename
+
+/* A directory under --watch */
+struct watch_dir {
+   char *path;               // ends in '/'
+   long long mtime_ns;       // when its subdirectories were last read
+   struct name_list subdirs; // its subdirectories as last seen, less excluded ones
+   int depth;                // levels below the directory the walk started at
+   size_t root_len;          // length of the start of path naming that directory
+};
+
+/* Every watched directory, indexed by inotify watch descriptor */
+struct watch_set {
+   int fd;
+   struct watch_dir **dirs;
+   int cap;
+   int limit_warned;
+};
+
+/* Path of the directory being listed, reused for every entry. It grows as needed
+ * and is only used for messages and path globs; directories are opened with
+ * openat(). */
+struct path_buf {
+   char *data;
+   size_t len;
+   size_t cap;
+};
+
+/* One directory on the stack of a serial walk. Its subdirectory names are
+ * collected before descending, so the entry buffer is free again for them. */
+struct walk_frame {
+   int fd;                   // -1 while closed to stay within the descriptor budget
+   dev_t dev;
+   ino_t ino;
+   struct name_list subdirs; // its subdirectories, output and walked in order
+   size_t pos;               // offset of the next name in subdirs
+   size_t path_len;          // length of its path in the walk's path buffer
+};
+
+/* State shared by every directory of a serial walk */
+struct walk_ctx {
+   struct path_buf path;    // path of the directory being listed, for error messages
+   struct dir_reader reader;
+   struct snapshot *snap;   // snapshot to reuse and update, or NULL
+   struct watch_set *watch; // watch every directory listed, or NULL
+   int report_created;      // print "created: PATH" lines instead of bare names
+   const struct walk_opts *opts;
+   struct visited_set visited;
+   struct walk_frame *stack;
+   int stack_cap;
+   int fd_budget;
+   size_t root_len;         // length of the start of path naming the given directory
+   int base_depth;          // level of the directory walk_tree() starts at
+};
+
+/* Append name and a '/' to the path, growing the buffer when needed.
+ * Returns the previous length so the caller can cut the path back to it. */
+size_t path_push(struct path_buf *path, const char *name){
+   size_t old_len = path->len;
+   size_t name_len = strlen(name);
+
+   if(path->len + name_len + 2 > path->cap){
+      size_t cap = path->cap ? path->cap : 256;
+
+      while(path->len + name_len + 2 > cap){
+         cap *= 2;
+      }
+      path->data = realloc(path->data, cap);
+      if(path->data == NULL){
+         fprintf(stderr, "lsdir: %s\n", strerror(errno));
+         exit(1);
+      }
+      path->cap = cap;
+   }
+   memcpy(path->data + path->len, name, name_len);
+   path->len += name_len;
+   path->data[path->len++] = '/';
+   path->data[path->len] = '\0';
+
+   return(old_len);
+} // END OF path_push
+
+/* Allocate a reader with a buffer of cap bytes */
+void reader_init(struct dir_reader *reader, size_t cap){
+   reader->buf = malloc(cap);
+   if(reader->buf == NULL){
+      fprintf(stderr, "lsdir: %s\n", strerror(errno));
+      exit(1);
+   }
+   reader->cap = cap;
+   reader->fd = -1;
+   reader->error = 0;
+   reader->len = 0;
+   reader->pos = 0;
+
+   return;
+} // END OF reader_init
+
+/* Start reading the entries of the open directory fd */
+void reader_start(struct dir_reader *reader, int fd){
+   reader->fd = fd;
+   reader->error = 0;
+   reader->len = 0;
+   reader->pos = 0;
+
+   return;
+} // END OF reader_start
+
+/* The next entry of the directory, or NULL at the end or on an error (then
+ * reader->error is set) */
+struct linux_dirent64 *reader_next(struct dir_reader *reader){
+   struct linux_dirent64 *entry;
+
+   if(reader->pos >= reader->len){
+      long nread;
+
+      do{
+         nread = syscall(SYS_getdents64, reader->fd, reader->buf, reader->cap);
+      }while(nread == -1 && errno == EINTR);
+      if(nread <= 0){
+         reader->error = (nread == -1) ? errno : 0;
+         reader->len = reader->pos = 0;
+         return(NULL);
+      }
+      reader->len = nread;
+      reader->pos = 0;
+   }
+   entry = (struct linux_dirent64 *)(reader->buf + reader->pos);
+   reader->pos += entry->d_reclen;
+
+   return(entry);
+} // END OF reader_next
+
+/* Add a name to the end of a name list */
+void name_list_add(struct name_list *names, const char *name){
+   size_t name_len = strlen(name) + 1;
+
+   if(names->len + name_len > names->cap){
+      size_t cap = names->cap ? names->cap : 256;
+
+      while(names->len + name_len > cap){
+         cap *= 2;
+      }
+      names->data = realloc(names->data, cap);
+      if(names->data == NULL){
+         fprintf(stderr, "lsdir: %s\n", strerror(errno));
+         exit(1);
+      }
+      names->cap = cap;
+   }
+   memcpy(names->data + names->len, name, name_len);
+   names->len += name_len;
+
+   return;
+} // END OF name_list_add
+
+/* Remove a name from a name list. Returns 1 if it was there. */
+int name_list_remove(struct name_list *names, const char *name){
+   size_t pos;
+
+   for(pos=0; pos<names->len; pos+=strlen(names->data + pos) + 1){
+      size_t name_len = strlen(names->data + pos) + 1;
+
+      if(strcmp(names->data + pos, name) == 0){
+         memmove(names->data + pos, names->data + pos + name_len, names->len - pos - name_len);
+         names->len -= name_len;
+         return(1);
+      }
+   }
+
+   return(0);
+} // END OF name_list_remove
+
+/* Whether a name is in a name list */
+int name_list_has(const struct name_list *names, const char *name){
+   size_t pos;
+
+   for(pos=0; pos<names->len; pos+=strlen(names->data + pos) + 1){
+      if(strcmp(names->data + pos, name) == 0){
+         return(1);
+      }
+   }
+
+   return(0);
+} // END OF name_list_has
+
+/* Whether a directory entry is a directory. The type comes from d_type when the
+ * filesystem reports one. A symlink is followed only when follow is set, so a link
+ * to a directory counts only then. */
+int entry_is_dir(int dir_fd, const struct linux_dirent64 *entry, int follow){
+   struct stat filestat;
+
+   if(entry->d_type == DT_DIR){
+      return(1);
+   }
+   if(entry->d_type == DT_UNKNOWN || (entry->d_type == DT_LNK && follow)){
+      return( (fstatat(dir_fd, entry->d_name, &filestat, follow ? 0 : AT_SYMLINK_NOFOLLOW) != -1) &&
+              S_ISDIR(filestat.st_mode) );
+   }
+
+   return(0);
+} // END OF entry_is_dir
+
+/* Find the slot of a directory in the visited set, adding an empty one if it is
+ * not there. The pointer is only good until the next call. */
+struct visited_slot *visited_lookup(struct visited_set *set, dev_t dev, ino_t ino){
+   size_t i;
+
+   // Keep the table at most half full
+   if(2 * (set->cnt + 1) > set->cap){
+      struct visited_slot *old = set->slots;
+      size_t old_cap = set->cap;
+
+      set->cap = old_cap ? old_cap * 2 : 1024;
+      set->slots = calloc(set->cap, sizeof(struct visited_slot));
+      if(set->slots == NULL){
+         fprintf(stderr, "lsdir: %s\n", strerror(errno));
+         exit(1);
+      }
+      set->cnt = 0;
+      for(i=0; i<old_cap; i++){
+         if(old[i].state != VISIT_EMPTY){
+            *visited_lookup(set, old[i].dev, old[i].ino) = old[i];
+            set->cnt++;
+         }
+      }
+      free(old);
+   }
+
+   i = ((unsigned long long)ino * 0x9E3779B97F4A7C15ULL ^ (unsigned long long)dev) & (set->cap - 1);
+   while(set->slots[i].state != VISIT_EMPTY && (set->slots[i].ino != ino || set->slots[i].dev != dev)){
+      i = (i + 1) & (set->cap - 1);
+   }
+   if(set->slots[i].state == VISIT_EMPTY){
+      set->slots[i].dev = dev;
+      set->slots[i].ino = ino;
+   }
+
+   return(&set->slots[i]);
+} // END OF visited_lookup
+
+/* Record a directory as walked. Returns its previous state, so VISIT_EMPTY means
+ * it is new. */
+int visited_enter(struct visited_set *set, dev_t dev, ino_t ino){
+   struct visited_slot *slot = visited_lookup(set, dev, ino);
+   int state = slot->state;
+
+   if(state == VISIT_EMPTY){
+      slot->state = VISIT_OPEN;
+      set->cnt++;
+   }
+
+   return(state);
+} // END OF visited_enter
+
+/* Forget every directory walked */
+void visited_clear(struct visited_set *set){
+   if(set->cnt > 0){
+      memset(set->slots, 0, set->cap * sizeof(struct visited_slot));
+      set->cnt = 0;
+   }
+
+   return;
+} // END OF visited_clear
+
+/* Whether a directory entry is . or .. */
+int is_dot_entry(const char *dname){
+   return(dname[0] == '.' && (dname[1] == '\0' || (dname[1] == '.' && dname[2] == '\0')));
+} // END OF is_dot_entry
+
+/* Parse the class starting at the '[' in p into set. Returns the end of the
+ * class, or NULL if there is no closing ']' (then the '[' is literal). */
+const char *glob_class(unsigned char *set, const char *p){
+   int negate = 0;
+   int i;
+
+   p++;
+   if(*p == '!' || *p == '^'){
+      negate = 1;
+      p++;
+   }
+   memset(set, 0, 32);
+   // A ']' right after the '[' is part of the class
+   do{
+      unsigned char first;
+      unsigned char last;
+
+      if(*p == '\\' && p[1] != '\0'){
+         p++;
+      }
+      if(*p == '\0'){
+         return(NULL);
+      }
+      first = last = *p++;
+      if(p[0] == '-' && p[1] != ']' && p[1] != '\0'){
+         p++;
+         if(*p == '\\' && p[1] != '\0'){
+            p++;
+         }
+         last = *p++;
+      }
+      for(i=first; i<=last; i++){
+         set[i >> 3] |= 1 << (i & 7);
+      }
+   }while(*p != ']');
+
+   if(negate){
+      for(i=0; i<32; i++){
+         set[i] = ~set[i];
+      }
+   }
+   set['/' >> 3] &= ~(1 << ('/' & 7)); // a class never matches a '/'
+
+   return(p + 1);
+} // END OF glob_class
+
+/* Compile a glob. A leading '/' (the glob is always anchored at the directory
+ * given) and a trailing '/' (everything matched is a directory) are dropped. */
+void glob_compile(struct glob *glob, const char *pattern){
+   size_t pattern_len;
+   size_t text_len = 0;
+   const char *p;
+
+   while(*pattern == '/'){
+      pattern++;
+   }
+   pattern_len = strlen(pattern);
+   glob->tokens = malloc((pattern_len + 1) * sizeof(struct glob_token));
+   glob->text = malloc(pattern_len + 1);
+   if(glob->tokens == NULL || glob->text == NULL){
+      fprintf(stderr, "lsdir: %s\n", strerror(errno));
+      exit(1);
+   }
+   glob->token_cnt = 0;
+   glob->is_path = 0;
+
+   for(p=pattern; *p!='\0' && !(*p == '/' && p[1] == '\0'); ){
+      struct glob_token *tok = &glob->tokens[glob->token_cnt];
+
+      if(*p == '*'){
+         // A run of stars matches the same as one
+         while(*p == '*'){
+            p++;
+         }
+         tok->type = GLOB_STAR;
+         glob->token_cnt++;
+         continue;
+      }
+      if(*p == '?'){
+         tok->type = GLOB_ANY;
+         glob->token_cnt++;
+         p++;
+         continue;
+      }
+      if(*p == '['){
+         const char *end = glob_class(tok->set, p);
+
+         if(end != NULL){
+            tok->type = GLOB_CLASS;
+            glob->token_cnt++;
+            p = end;
+            continue;
+         }
+      }
+
+      // Literal text joins the run before it
+      if(*p == '\\' && p[1] != '\0'){
+         p++;
+      }
+      if(*p == '/'){
+         glob->is_path = 1;
+      }
+      if(glob->token_cnt == 0 || glob->tokens[glob->token_cnt - 1].type != GLOB_LITERAL){
+         tok->type = GLOB_LITERAL;
+         tok->len = 0;
+         tok->text = glob->text + text_len;
+         glob->token_cnt++;
+      }
+      glob->text[text_len++] = *p++;
+      glob->tokens[glob->token_cnt - 1].len++;
+   }
+
+   return;
+} // END OF glob_compile
+
+/* Whether the len bytes at str match a compiled glob. A * or ? never matches a '/'. */
+int glob_match(const struct glob *glob, const char *str, size_t len){
+   int ti = 0;
+   int star_ti = -1; // the last * seen, and where its match ends so far
+   size_t si = 0;
+   size_t star_si = 0;
+
+   for(;;){
+      if(ti < glob->token_cnt){
+         const struct glob_token *tok = &glob->tokens[ti];
+         unsigned char c = (si < len) ? str[si] : '\0';
+
+         switch(tok->type){
+            case GLOB_STAR:
+               star_ti = ti++;
+               star_si = si;
+               continue;
+            case GLOB_LITERAL:
+               if(len - si >= tok->len && memcmp(str + si, tok->text, tok->len) == 0){
+                  si += tok->len;
+                  ti++;
+                  continue;
+               }
+               break;
+            case GLOB_ANY:
+               if(si < len && c != '/'){
+                  si++;
+                  ti++;
+                  continue;
+               }
+               break;
+            case GLOB_CLASS:
+               if(si < len && (tok->set[c >> 3] & (1 << (c & 7)))){
+                  si++;
+                  ti++;
+                  continue;
+               }
+               break;
+         }
+      }
+      else if(si == len){
+         return(1);
+      }
+
+      // No match here: let the last * take one more byte and try again
+      if(star_ti < 0 || star_si >= len || str[star_si] == '/'){
+         return(0);
+      }
+      star_si++;
+      si = star_si;
+      ti = star_ti + 1;
+   }
+} // END OF glob_match
+
+/* Whether a subdirectory is excluded. relpath (relpath_len bytes, no trailing
+ * '/') is its path below the directory given. */
+int walk_excluded(const struct walk_opts *opts, const char *name, const char *relpath, size_t relpath_len){
+   size_t name_len = strlen(name);
+   int i;
+
+   for(i=0; i<opts->exclude_cnt; i++){
+      const struct glob *glob = &opts->excludes[i];
+
+      if(glob->is_path ? glob_match(glob, relpath, relpath_len) : glob_match(glob, name, name_len)){
+         return(1);
+      }
+   }
+
+   return(0);
+} // END OF walk_excluded
+
+/* What to do with a subdirectory that is not excluded, at the given level:
+ * WALK_SHOW and/or WALK_DESCEND */
+int walk_action(const struct walk_opts *opts, const char *name, int depth){
+   int action = WALK_SHOW | WALK_DESCEND;
+   size_t name_len = strlen(name);
+   int i;
+
+   if(depth < opts->mindepth){
+      action &= ~WALK_SHOW;
+   }
+   if(depth >= opts->maxdepth){
+      action &= ~WALK_DESCEND;
+   }
+   for(i=0; i<opts->prune_cnt && (action & WALK_DESCEND); i++){
+      if(glob_match(&opts->prunes[i], name, name_len)){
+         action &= ~WALK_DESCEND;
+      }
+   }
+
+   return(action);
+} // END OF walk_action
+
+/* Grow a snapshot array so it has room for one more element */
+void *snap_grow(void *array, long long *cap, long long cnt, size_t elem_size){
+   if(cnt < *cap){
+      return(array);
+   }
+   *cap = *cap ? *cap * 2 : 1024;
+   array = realloc(array, *cap * elem_size);
+   if(array == NULL){
+      fprintf(stderr, "lsdir: %s\n", strerror(errno));
+      exit(1);
+   }
+
+   return(array);
+} // END OF snap_grow
+
+/* Whether every child range and name offset of a mapped snapshot is in bounds */
+int snapshot_valid(const struct snap_header *hdr, const struct snap_dir *dirs,
+                   const struct snap_child *children, const char *names){
+   long long i;
+
+   for(i=0; i<hdr->dir_cnt; i++){
+      if(dirs[i].first_child < 0 || dirs[i].child_cnt < 0 || dirs[i].first_child + dirs[i].child_cnt > hdr->child_cnt){
+         return(0);
+      }
+   }
+   for(i=0; i<hdr->child_cnt; i++){
+      if(children[i].name_off < 0 || children[i].name_off >= hdr->names_len){
+         return(0);
+      }
+   }
+
+   return(hdr->names_len == 0 || names[hdr->names_len - 1] == '\0');
+} // END OF snapshot_valid
+
+/* Map the snapshot left by the last run. A missing or damaged file just means
+ * every directory is read. */
+void snapshot_load(struct snapshot *snap, const char *filename){
+   const struct snap_header *hdr;
+   struct stat filestat;
+   struct timespec now;
+   int fd = open(filename, O_RDONLY | O_CLOEXEC);
+
+   memset(snap, 0, sizeof(*snap));
+   clock_gettime(CLOCK_REALTIME, &now);
+   snap->taken_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+   if(fd == -1){
+      return;
+   }
+   if(fstat(fd, &filestat) == -1 || filestat.st_size < (off_t)sizeof(struct snap_header)){
+      close(fd);
+      return;
+   }
+   snap->map = mmap(NULL, filestat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if(snap->map == MAP_FAILED){
+      snap->map = NULL;
+      return;
+   }
+   snap->map_len = filestat.st_size;
+
+   // Check the layout before trusting any offset in it
+   hdr = snap->map;
+   if(memcmp(hdr->magic, SNAPSHOT_MAGIC, 8) != 0 || hdr->version != SNAPSHOT_VERSION ||
+      hdr->dir_cnt < 0 || hdr->child_cnt < 0 || hdr->names_len < 0 ||
+      (unsigned long long)snap->map_len != sizeof(struct snap_header) + hdr->dir_cnt * sizeof(struct snap_dir) +
+                                           hdr->child_cnt * sizeof(struct snap_child) + hdr->names_len){
+      munmap(snap->map, snap->map_len);
+      snap->map = NULL;
+      return;
+   }
+   snap->dirs = (const struct snap_dir *)(hdr + 1);
+   snap->children = (const struct snap_child *)(snap->dirs + hdr->dir_cnt);
+   snap->names = (const char *)(snap->children + hdr->child_cnt);
+   if(!snapshot_valid(hdr, snap->dirs, snap->children, snap->names)){
+      munmap(snap->map, snap->map_len);
+      snap->map = NULL;
+      return;
+   }
+   snap->dir_cnt = hdr->dir_cnt;
+   // Directory mtimes come from the filesystem's clock, which can be a second
+   // coarser than the one the run started by, so trust only whole seconds before it
+   snap->trusted_ns = hdr->taken_ns - hdr->taken_ns % 1000000000LL;
+
+   return;
+} // END OF snapshot_load
+
+/* The last run's record of a directory, if its inode and mtime still match and
+ * that mtime is old enough that a change in the same tick cannot hide behind it */
+const struct snap_dir *snapshot_find(const struct snapshot *snap, const struct stat *dirstat){
+   long long low = 0;
+   long long high = snap->dir_cnt - 1;
+
+   while(low <= high){
+      long long mid = low + (high - low) / 2;
+      const struct snap_dir *dir = &snap->dirs[mid];
+
+      if(dir->dev == (unsigned long long)dirstat->st_dev && dir->ino == (unsigned long long)dirstat->st_ino){
+         long long mtime_ns = dirstat->st_mtim.tv_sec * 1000000000LL + dirstat->st_mtim.tv_nsec;
+
+         return(dir->mtime_ns == mtime_ns && mtime_ns < snap->trusted_ns ? dir : NULL);
+      }
+      if(dir->dev < (unsigned long long)dirstat->st_dev ||
+         (dir->dev == (unsigned long long)dirstat->st_dev && dir->ino < (unsigned long long)dirstat->st_ino)){
+         low = mid + 1;
+      }
+      else{
+         high = mid - 1;
+      }
+   }
+
+   return(NULL);
+} // END OF snapshot_find
+
+/* Record one entry of the directory being listed in the new snapshot */
+void snapshot_add_child(struct snapshot *snap, const char *name, int is_link){
+   long long name_len = strlen(name) + 1;
+
+   snap->new_children = snap_grow(snap->new_children, &snap->new_child_cap, snap->new_child_cnt, sizeof(struct snap_child));
+   while(snap->new_names_len + name_len > snap->new_names_cap){
+      snap->new_names = snap_grow(snap->new_names, &snap->new_names_cap, snap->new_names_cap, 1);
+   }
+   snap->new_children[snap->new_child_cnt].name_off = snap->new_names_len;
+   snap->new_children[snap->new_child_cnt].is_link = is_link;
+   snap->new_child_cnt++;
+   memcpy(snap->new_names + snap->new_names_len, name, name_len);
+   snap->new_names_len += name_len;
+
+   return;
+} // END OF snapshot_add_child
+
+/* Record a directory whose entries are the children added since first_child */
+void snapshot_add_dir(struct snapshot *snap, const struct stat *dirstat, long long first_child){
+   struct snap_dir *dir;
+
+   snap->new_dirs = snap_grow(snap->new_dirs, &snap->new_dir_cap, snap->new_dir_cnt, sizeof(struct snap_dir));
+   dir = &snap->new_dirs[snap->new_dir_cnt++];
+   dir->dev = dirstat->st_dev;
+   dir->ino = dirstat->st_ino;
+   dir->mtime_ns = dirstat->st_mtim.tv_sec * 1000000000LL + dirstat->st_mtim.tv_nsec;
+   dir->first_child = first_child;
+   dir->child_cnt = snap->new_child_cnt - first_child;
+
+   return;
+} // END OF snapshot_add_dir
+
+/* qsort comparator for snapshot directories: by device, then inode */
+int compare_snap_dir(const void *a, const void *b){
+   const struct snap_dir *da = a;
+   const struct snap_dir *db = b;
+
+   if(da->dev != db->dev){
+      return(da->dev < db->dev ? -1 : 1);
+   }
+   if(da->ino != db->ino){
+      return(da->ino < db->ino ? -1 : 1);
+   }
+
+   return(0);
+} // END OF compare_snap_dir
+
+/* Write the new snapshot through a temporary file renamed over filename, then
+ * release both snapshots. The temporary file gets a unique name from mkstemp(),
+ * so concurrent runs cannot clobber each other's and a planted symlink cannot
+ * redirect the write. */
+void snapshot_save(struct snapshot *snap, const char *filename){
+   struct snap_header hdr;
+   size_t name_len = strlen(filename);
+   char *tmp_name = malloc(name_len + 8);
+   FILE *fp = NULL;
+   mode_t mask;
+   int fd = -1;
+   int ok = 0;
+
+   memcpy(hdr.magic, SNAPSHOT_MAGIC, 8);
+   hdr.version = SNAPSHOT_VERSION;
+   hdr.dir_cnt = snap->new_dir_cnt;
+   hdr.child_cnt = snap->new_child_cnt;
+   hdr.names_len = snap->new_names_len;
+   hdr.taken_ns = snap->taken_ns;
+   qsort(snap->new_dirs, snap->new_dir_cnt, sizeof(struct snap_dir), compare_snap_dir);
+
+   if(tmp_name != NULL){
+      memcpy(tmp_name, filename, name_len);
+      memcpy(tmp_name + name_len, ".XXXXXX", 8);
+      fd = mkstemp(tmp_name);
+   }
+   if(fd != -1){
+      // mkstemp() creates the file 0600; give the snapshot the usual 0644 less umask
+      mask = umask(0);
+      umask(mask);
+      if(fchmod(fd, 0644 & ~mask) == 0){
+         fp = fdopen(fd, "w");
+      }
+      if(fp == NULL){
+         int err = errno;
+
+         close(fd);
+         unlink(tmp_name);
+         errno = err;
+      }
+   }
+   if(fp != NULL){
+      ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+           fwrite(snap->new_dirs, sizeof(struct snap_dir), snap->new_dir_cnt, fp) == (size_t)snap->new_dir_cnt &&
+           fwrite(snap->new_children, sizeof(struct snap_child), snap->new_child_cnt, fp) == (size_t)snap->new_child_cnt &&
+           fwrite(snap->new_names, 1, snap->new_names_len, fp) == (size_t)snap->new_names_len;
+      ok = (fclose(fp) == 0) && ok;
+      ok = ok && rename(tmp_name, filename) == 0;
+      if(!ok){
+         int err = errno;
+
+         unlink(tmp_name);
+         errno = err;
+      }
+   }
+   if(!ok){
+      fprintf(stderr, "lsdir: %s: %s\n", filename, strerror(errno));
+   }
+   free(tmp_name);
+
+   if(snap->map != NULL){
+      munmap(snap->map, snap->map_len);
+   }
+   free(snap->new_dirs);
+   free(snap->new_children);
+   free(snap->new_names);
+
+   return;
+} // END OF snapshot_save
+
+/* Whether a symlink in dir_fd leads to a directory */
+int link_is_dir(int dir_fd, const char *name){
    struct stat filestat;
 
-   startdir_ptr = opendir(dirname); 
+   return( (fstatat(dir_fd, name, &filestat, 0) != -1) && S_ISDIR(filestat.st_mode) );
+} // END OF link_is_dir
+
+/* Read the entries of dir_fd, keeping the subdirectories in subdirs and, with a
+ * snapshot, recording the subdirectories and symlinks as this directory's
+ * children. Returns 0, or -1 if reading failed part way. */
+int read_subdirs(int dir_fd, struct walk_ctx *ctx, struct name_list *subdirs){
+   struct linux_dirent64 *currentdir_ptr;
+   struct dir_reader *reader = &ctx->reader;
+
+   reader_start(reader, dir_fd);
+   while( (currentdir_ptr = reader_next(reader)) != NULL){
+      char *dname = currentdir_ptr->d_name;
+      struct stat filestat;
+
+      // Skip . and .. without touching the filesystem
+      if(is_dot_entry(dname)){
+         continue;
+      }
+      // Keep only entries that really are directories and not files
+      if(ctx->snap == NULL){
+         if(entry_is_dir(dir_fd, currentdir_ptr, ctx->opts->follow)){
+            name_list_add(subdirs, dname);
+         }
+         continue;
+      }
+
+      // With a snapshot, symlinks are told apart from directories and always
+      // recorded, so they can be checked again on the next run, with or without -L
+      if(currentdir_ptr->d_type == DT_UNKNOWN && fstatat(dir_fd, dname, &filestat, AT_SYMLINK_NOFOLLOW) != -1){
+         currentdir_ptr->d_type = S_ISDIR(filestat.st_mode) ? DT_DIR : S_ISLNK(filestat.st_mode) ? DT_LNK : DT_REG;
+      }
+      if(currentdir_ptr->d_type == DT_DIR){
+         snapshot_add_child(ctx->snap, dname, 0);
+         name_list_add(subdirs, dname);
+      }
+      else if(currentdir_ptr->d_type == DT_LNK){
+         snapshot_add_child(ctx->snap, dname, 1);
+         if(ctx->opts->follow && link_is_dir(dir_fd, dname)){
+            name_list_add(subdirs, dname);
+         }
+      }
+   }
+   if(reader->error){
+      fprintf(stderr, "lsdir: %s: %s\n", ctx->path.data, strerror(reader->error));
+      return(-1);
+   }
+
+   return(0);
+} // END OF read_subdirs
+
+/* Start watching the directory at path, open as dir_fd, remembering its
+ * subdirectories. Running out of watches is reported once. */
+void watch_add(struct watch_set *ws, const char *path, int depth, size_t root_len, int dir_fd,
+               const struct name_list *subdirs){
+   struct watch_dir *dir;
+   struct stat dirstat;
+   int wd = inotify_add_watch(ws->fd, path, WATCH_MASK);
+
+   if(wd == -1){
+      if(errno != ENOSPC || !ws->limit_warned){
+         fprintf(stderr, "lsdir: %s: %s%s\n", path, strerror(errno),
+                 errno == ENOSPC ? " (raise fs.inotify.max_user_watches)" : "");
+         ws->limit_warned |= (errno == ENOSPC);
+      }
+      return;
+   }
+   if(wd >= ws->cap){
+      int cap = ws->cap ? ws->cap : 1024;
+
+      while(wd >= cap){
+         cap *= 2;
+      }
+      ws->dirs = realloc(ws->dirs, cap * sizeof(struct watch_dir *));
+      if(ws->dirs == NULL){
+         fprintf(stderr, "lsdir: %s\n", strerror(errno));
+         exit(1);
+      }
+      memset(ws->dirs + ws->cap, 0, (cap - ws->cap) * sizeof(struct watch_dir *));
+      ws->cap = cap;
+   }
+
+   // The same directory reached again through a symlink keeps its first record,
+   // but one found again after a move the events did not show takes the new path
+   dir = ws->dirs[wd];
+   if(fstat(dir_fd, &dirstat) == -1){
+      memset(&dirstat, 0, sizeof(dirstat));
+   }
+   if(dir == NULL){
+      dir = calloc(1, sizeof(struct watch_dir));
+      if(dir == NULL){
+         fprintf(stderr, "lsdir: %s\n", strerror(errno));
+         exit(1);
+      }
+      ws->dirs[wd] = dir;
+   }
+   else{
+      struct stat oldstat;
+
+      if(strcmp(dir->path, path) != 0 && stat(dir->path, &oldstat) == 0 &&
+         oldstat.st_dev == dirstat.st_dev && oldstat.st_ino == dirstat.st_ino){
+         return;
+      }
+      free(dir->path);
+   }
+   dir->path = strdup(path);
+   if(dir->path == NULL){
+      fprintf(stderr, "lsdir: %s\n", strerror(errno));
+      exit(1);
+   }
+   if(dir->subdirs.cap < subdirs->len){
+      dir->subdirs.data = realloc(dir->subdirs.data, subdirs->len);
+      if(dir->subdirs.data == NULL){
+         fprintf(stderr, "lsdir: %s\n", strerror(errno));
+         exit(1);
+      }
+      dir->subdirs.cap = subdirs->len;
+   }
+   if(subdirs->len > 0){
+      memcpy(dir->subdirs.data, subdirs->data, subdirs->len);
+   }
+   dir->subdirs.len = subdirs->len;
+   dir->depth = depth;
+   dir->root_len = root_len;
+   dir->mtime_ns = dirstat.st_mtim.tv_sec * 1000000000LL + dirstat.st_mtim.tv_nsec;
+
+   return;
+} // END OF watch_add
+
+/* Take the excluded names out of the subdirectories of the directory in ctx->path */
+void exclude_subdirs(struct walk_ctx *ctx, struct name_list *subdirs){
+   struct path_buf *path = &ctx->path;
+   size_t dir_len = path->len;
+   size_t pos;
+   size_t kept = 0;
+
+   for(pos=0; pos<subdirs->len; ){
+      char *dname = subdirs->data + pos;
+      size_t name_len = strlen(dname) + 1;
+      int excluded;
+
+      path_push(path, dname);
+      excluded = walk_excluded(ctx->opts, dname, path->data + ctx->root_len, path->len - 1 - ctx->root_len);
+      path->len = dir_len;
+      path->data[dir_len] = '\0';
+      if(!excluded){
+         memmove(subdirs->data + kept, dname, name_len);
+         kept += name_len;
+      }
+      pos += name_len;
+   }
+   subdirs->len = kept;
+
+   return;
+} // END OF exclude_subdirs
+
+/* Collect the subdirectories of the open directory dir_fd (described by dirstat,
+ * depth levels down) into subdirs, from the snapshot when it is unchanged, and
+ * watch it under --watch. Symlinks among a snapshot's entries are checked again,
+ * since their targets can change without touching the directory. */
+void collect_subdirs(int dir_fd, const struct stat *dirstat, int depth, struct walk_ctx *ctx, struct name_list *subdirs){
+   struct snapshot *snap = ctx->snap;
+
+   subdirs->len = 0;
+   if(snap != NULL){
+      long long first_child = snap->new_child_cnt;
+      const struct snap_dir *old = snapshot_find(snap, dirstat);
+
+      if(old != NULL){
+         long long c;
+
+         for(c=old->first_child; c<old->first_child + old->child_cnt; c++){
+            const char *dname = snap->names + snap->children[c].name_off;
+
+            snapshot_add_child(snap, dname, snap->children[c].is_link);
+            if(!snap->children[c].is_link || (ctx->opts->follow && link_is_dir(dir_fd, dname))){
+               name_list_add(subdirs, dname);
+            }
+         }
+         snapshot_add_dir(snap, dirstat, first_child);
+      }
+      else if(read_subdirs(dir_fd, ctx, subdirs) == 0){
+         snapshot_add_dir(snap, dirstat, first_child);
+      }
+   }
+   else{
+      read_subdirs(dir_fd, ctx, subdirs);
+   }
+   if(ctx->opts->exclude_cnt > 0){
+      exclude_subdirs(ctx, subdirs);
+   }
+   if(ctx->watch != NULL){
+      watch_add(ctx->watch, ctx->path.data, depth, ctx->root_len, dir_fd, subdirs);
+   }
+
+   return;
+} // END OF collect_subdirs
+
+/* Push the open directory dir_fd (whose path is in ctx->path) onto the walk
+ * stack and collect its subdirectories. Returns the new depth. */
+int walk_push(struct walk_ctx *ctx, int depth, int dir_fd, const struct stat *dirstat){
+   struct walk_frame *frame;
+
+   if(depth == ctx->stack_cap){
+      int cap = ctx->stack_cap ? ctx->stack_cap * 2 : 64;
+
+      ctx->stack = realloc(ctx->stack, cap * sizeof(struct walk_frame));
+      if(ctx->stack == NULL){
+         fprintf(stderr, "lsdir: %s\n", strerror(errno));
+         exit(1);
+      }
+      // Name buffers stay with their level and are reused by later directories
+      memset(ctx->stack + ctx->stack_cap, 0, (cap - ctx->stack_cap) * sizeof(struct walk_frame));
+      ctx->stack_cap = cap;
+   }
+   frame = &ctx->stack[depth];
+   frame->fd = dir_fd;
+   frame->dev = dirstat->st_dev;
+   frame->ino = dirstat->st_ino;
+   frame->pos = 0;
+   frame->path_len = ctx->path.len;
+   collect_subdirs(dir_fd, dirstat, ctx->base_depth + depth, ctx, &frame->subdirs);
+
+   return(depth + 1);
+} // END OF walk_push
+
+/* Open the directory at path, however long the path is. A path that does not fit
+ * in PATH_MAX is opened a piece at a time with openat(), each piece ending at a
+ * '/'. Returns the descriptor, or -1 with errno set. */
+int open_dir_path(const char *path){
+   char piece[PATH_MAX];
+   int dir_fd = AT_FDCWD;
+   int fd;
+
+   while(strlen(path) >= PATH_MAX){
+      const char *cut = path + PATH_MAX - 2;
+
+      while(cut >= path && *cut != '/'){
+         cut--;
+      }
+      if(cut < path){
+         errno = ENAMETOOLONG;
+         fd = -1;
+         break;
+      }
+      memcpy(piece, path, cut - path + 1);
+      piece[cut - path + 1] = '\0';
+      fd = openat(dir_fd, piece, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if(dir_fd != AT_FDCWD){
+         close(dir_fd);
+      }
+      if(fd == -1){
+         return(-1);
+      }
+      dir_fd = fd;
+      path = cut + 1;
+   }
+   if(strlen(path) < PATH_MAX){
+      fd = openat(dir_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+   }
+   if(dir_fd != AT_FDCWD){
+      int err = errno;
+
+      close(dir_fd);
+      errno = err;
+   }
+
+   return(fd);
+} // END OF open_dir_path
+
+/* Reopen a directory on the walk stack whose descriptor was closed, through the
+ * ".." of its child child_fd or else through its path. Returns 0, or -1. */
+int walk_reopen(struct walk_ctx *ctx, struct walk_frame *frame, int child_fd){
+   struct stat dirstat;
+   int i;
+
+   for(i=0; i<2; i++){
+      int fd = (i == 0) ? openat(child_fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+                        : open_dir_path(ctx->path.data);
+
+      if(fd == -1){
+         continue;
+      }
+      // Under -L ".." is not always the directory we came from
+      if(fstat(fd, &dirstat) == 0 && dirstat.st_dev == frame->dev && dirstat.st_ino == frame->ino){
+         frame->fd = fd;
+         return(0);
+      }
+      close(fd);
+   }
+   fprintf(stderr, "lsdir: %s: cannot reopen directory\n", ctx->path.data);
+
+   return(-1);
+} // END OF walk_reopen
+
+/* Walk the tree under the directory whose path is in ctx->path, outputting each
+ * subdirectory name before the subdirectories under it. The walk keeps its own
+ * stack so any depth is fine, and closes the shallowest descriptors once more
+ * than ctx->fd_budget are open; those are reopened through ".." on the way back. */
+void walk_tree(struct walk_ctx *ctx){
+   struct path_buf *path = &ctx->path;
+   struct stat dirstat;
+   int depth = 0;
+   int open_cnt = 1;
+   int lowest_open = 0; // every level below this one has its descriptor closed
+   dev_t root_dev;
+   int dir_fd;
+
+   if(ctx->base_depth >= ctx->opts->maxdepth){
+      return;
+   }
+   dir_fd = open(path->data, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+   if(dir_fd == -1 || fstat(dir_fd, &dirstat) == -1){
+      fprintf(stderr, "lsdir: %s: %s\n", path->data, strerror(errno));
+      if(dir_fd != -1){
+         close(dir_fd);
+      }
+      return;
+   }
+   root_dev = dirstat.st_dev;
+   visited_enter(&ctx->visited, dirstat.st_dev, dirstat.st_ino);
+   depth = walk_push(ctx, depth, dir_fd, &dirstat);
+
+   while(depth > 0){
+      struct walk_frame *top = &ctx->stack[depth - 1];
+      char *dname;
+      int action;
+      int state;
+
+      // Done with this directory: go back up to its parent
+      if(top->pos >= top->subdirs.len){
+         struct walk_frame *parent = (depth > 1) ? top - 1 : NULL;
+
+         visited_lookup(&ctx->visited, top->dev, top->ino)->state = VISIT_DONE;
+         path->len = parent ? parent->path_len : top->path_len;
+         path->data[path->len] = '\0';
+         if(parent != NULL && parent->fd == -1 && parent->pos < parent->subdirs.len){
+            if(walk_reopen(ctx, parent, top->fd) == 0){
+               open_cnt++;
+               lowest_open = depth - 2;
+            }
+            else{
+               parent->pos = parent->subdirs.len;
+            }
+         }
+         if(top->fd != -1){
+            if(close(top->fd) == -1){
+               fprintf(stderr, "lsdir: close: %s\n", strerror(errno));
+            }
+            open_cnt--;
+         }
+         depth--;
+         if(lowest_open > depth){
+            lowest_open = depth;
+         }
+         continue;
+      }
+
+      dname = top->subdirs.data + top->pos;
+      top->pos += strlen(dname) + 1;
+      action = walk_action(ctx->opts, dname, ctx->base_depth + depth);
+      if((action & WALK_SHOW) && ctx->report_created){
+         printf("created: %s%s\n", path->data, dname);
+      }
+      else if(action & WALK_SHOW){
+         printf("%s\n", dname);
+      }
+      if(!(action & WALK_DESCEND)){
+         continue;
+      }
+
+      path_push(path, dname);
+      dir_fd = openat(top->fd, dname, O_RDONLY | O_DIRECTORY | O_CLOEXEC | (ctx->opts->follow ? 0 : O_NOFOLLOW));
+      if(dir_fd == -1 || fstat(dir_fd, &dirstat) == -1){
+         fprintf(stderr, "lsdir: %s: %s\n", path->data, strerror(errno));
+         state = VISIT_DONE;
+      }
+      else if(ctx->opts->one_fs && dirstat.st_dev != root_dev){
+         state = VISIT_DONE;
+      }
+      else{
+         state = visited_enter(&ctx->visited, dirstat.st_dev, dirstat.st_ino);
+         if(state == VISIT_OPEN){
+            fprintf(stderr, "lsdir: %s: filesystem loop detected\n", path->data);
+         }
+      }
+      if(state != VISIT_EMPTY){
+         if(dir_fd != -1){
+            close(dir_fd);
+         }
+         path->len = top->path_len;
+         path->data[path->len] = '\0';
+         continue;
+      }
+
+      // Stay within the descriptor budget by closing the shallowest ones
+      open_cnt++;
+      while(open_cnt > ctx->fd_budget && lowest_open < depth){
+         if(ctx->stack[lowest_open].fd != -1){
+            close(ctx->stack[lowest_open].fd);
+            ctx->stack[lowest_open].fd = -1;
+            open_cnt--;
+         }
+         lowest_open++;
+      }
+      depth = walk_push(ctx, depth, dir_fd, &dirstat);
+   }
+   visited_clear(&ctx->visited);
+
+   return;
+} // END OF walk_tree
+
+/* Point the walk's path buffer at dirname */
+void path_set(struct path_buf *path, const char *dirname){
+   size_t dirname_len = strlen(dirname);
+
+   if(dirname_len + 1 > path->cap){
+      path->data = realloc(path->data, dirname_len + 1);
+      if(path->data == NULL){
+         fprintf(stderr, "lsdir: %s\n", strerror(errno));
+         exit(1);
+      }
+      path->cap = dirname_len + 1;
+   }
+   memcpy(path->data, dirname, dirname_len + 1);
+   path->len = dirname_len;
+
+   return;
+} // END OF path_set
+
+/* Set up a serial walk */
+void walk_init(struct walk_ctx *ctx, size_t dirbuf_size, const struct walk_opts *opts){
+   struct rlimit fd_limit;
+
+   memset(ctx, 0, sizeof(struct walk_ctx));
+   reader_init(&ctx->reader, dirbuf_size);
+   ctx->opts = opts;
+   ctx->fd_budget = MAX_OPEN_DIRS;
+   if(getrlimit(RLIMIT_NOFILE, &fd_limit) == 0 && fd_limit.rlim_cur != RLIM_INFINITY &&
+      fd_limit.rlim_cur / 2 < MAX_OPEN_DIRS){
+      ctx->fd_budget = (fd_limit.rlim_cur / 2 > 1) ? fd_limit.rlim_cur / 2 : 1;
+   }
+
+   return;
+} // END OF walk_init
+
+/* Free what a serial walk allocated */
+void walk_free(struct walk_ctx *ctx){
+   int i;
+
+   for(i=0; i<ctx->stack_cap; i++){
+      free(ctx->stack[i].subdirs.data);
+   }
+   free(ctx->stack);
+   free(ctx->visited.slots);
+   free(ctx->reader.buf);
+   free(ctx->path.data);
+
+   return;
+} // END OF walk_free
+
+/* ARG dirname: the full or relative path directory name whose subdirectories should be output
+ * ARG dirbuf_size: bytes of directory entries to read at a time
+ * ARG opts: how to walk the tree
+ * ARG snap: snapshot to reuse and update, or NULL
+ * ARG watch: watch every directory of the tree, or NULL */
+void list_directories(char *dirname, size_t dirbuf_size, const struct walk_opts *opts, struct snapshot *snap,
+                      struct watch_set *watch){
+   struct walk_ctx ctx;
+
+   walk_init(&ctx, dirbuf_size, opts);
+   ctx.snap = snap;
+   ctx.watch = watch;
+   path_set(&ctx.path, dirname);
+   ctx.root_len = ctx.path.len;
+
+   walk_tree(&ctx);
+   walk_free(&ctx);
+
+   return;
+} // END OF list_directories 
+
+
+
+/* Stop watching every directory whose path starts with prefix */
+void watch_drop_prefix(struct watch_set *ws, const char *prefix){
+   size_t prefix_len = strlen(prefix);
+   int wd;
+
+   for(wd=0; wd<ws->cap; wd++){
+      struct watch_dir *dir = ws->dirs[wd];
+
+      if(dir != NULL && strncmp(dir->path, prefix, prefix_len) == 0){
+         inotify_rm_watch(ws->fd, wd);
+         free(dir->path);
+         free(dir->subdirs.data);
+         free(dir);
+         ws->dirs[wd] = NULL;
+      }
+   }
+
+   return;
+} // END OF watch_drop_prefix
+
+/* Report a subdirectory that appeared, then walk and watch everything under it.
+ * One the walk of a new parent already found is not reported twice. */
+void watch_created(struct walk_ctx *ctx, struct watch_dir *parent, const char *name){
+   int action;
+
+   if(name_list_has(&parent->subdirs, name)){
+      return;
+   }
+   path_set(&ctx->path, parent->path);
+   path_push(&ctx->path, name);
+   if(walk_excluded(ctx->opts, name, ctx->path.data + parent->root_len, ctx->path.len - 1 - parent->root_len)){
+      return;
+   }
+   action = walk_action(ctx->opts, name, parent->depth + 1);
+   if(action & WALK_SHOW){
+      printf("created: %s%s\n", parent->path, name);
+   }
+   name_list_add(&parent->subdirs, name);
+
+   if(action & WALK_DESCEND){
+      ctx->root_len = parent->root_len;
+      ctx->base_depth = parent->depth + 1;
+      ctx->report_created = 1;
+      walk_tree(ctx);
+      ctx->report_created = 0;
+   }
+
+   return;
+} // END OF watch_created
+
+/* Report a subdirectory that went away and forget the subtree under it.
+ * One that was never reported is dropped quietly. */
+void watch_removed(struct watch_set *ws, struct walk_ctx *ctx, struct watch_dir *parent, const char *name){
+   if(!name_list_remove(&parent->subdirs, name)){
+      return;
+   }
+   if(parent->depth + 1 >= ctx->opts->mindepth){
+      printf("removed: %s%s\n", parent->path, name);
+   }
+
+   path_set(&ctx->path, parent->path);
+   path_push(&ctx->path, name);
+   watch_drop_prefix(ws, ctx->path.data);
+
+   return;
+} // END OF watch_removed
+
+/* Report a subdirectory renamed inside the tree and move the paths of the
+ * subtree under it. A rename that changes its level or how the filters treat
+ * it is reported as a removal and a creation instead. */
+void watch_renamed(struct watch_set *ws, struct walk_ctx *ctx, struct watch_dir *from, const char *from_name,
+                   struct watch_dir *to, const char *to_name){
+   char *old_prefix;
+   size_t old_len;
+   int wd;
+
+   path_set(&ctx->path, to->path);
+   path_push(&ctx->path, to_name);
+   if(!name_list_has(&from->subdirs, from_name) || from->depth != to->depth || ctx->opts->path_exclude_cnt > 0 ||
+      from->root_len != to->root_len || strncmp(from->path, to->path, from->root_len) != 0 ||
+      walk_excluded(ctx->opts, to_name, ctx->path.data + to->root_len, ctx->path.len - 1 - to->root_len) ||
+      walk_action(ctx->opts, from_name, from->depth + 1) != walk_action(ctx->opts, to_name, to->depth + 1)){
+      watch_removed(ws, ctx, from, from_name);
+      watch_created(ctx, to, to_name);
+      return;
+   }
+   if(walk_action(ctx->opts, to_name, to->depth + 1) & WALK_SHOW){
+      printf("renamed: %s%s -> %s%s\n", from->path, from_name, to->path, to_name);
+   }
+   name_list_remove(&from->subdirs, from_name);
+   if(!name_list_has(&to->subdirs, to_name)){
+      name_list_add(&to->subdirs, to_name);
+   }
+
+   path_set(&ctx->path, from->path);
+   path_push(&ctx->path, from_name);
+   old_prefix = strdup(ctx->path.data);
+   path_set(&ctx->path, to->path);
+   path_push(&ctx->path, to_name);
+   if(old_prefix == NULL){
+      fprintf(stderr, "lsdir: %s\n", strerror(errno));
+      exit(1);
+   }
+   old_len = strlen(old_prefix);
+
+   for(wd=0; wd<ws->cap; wd++){
+      struct watch_dir *dir = ws->dirs[wd];
+
+      if(dir != NULL && strncmp(dir->path, old_prefix, old_len) == 0){
+         size_t rest_len = strlen(dir->path + old_len);
+         char *moved = malloc(ctx->path.len + rest_len + 1);
+
+         if(moved == NULL){
+            fprintf(stderr, "lsdir: %s\n", strerror(errno));
+            exit(1);
+         }
+         memcpy(moved, ctx->path.data, ctx->path.len);
+         memcpy(moved + ctx->path.len, dir->path + old_len, rest_len + 1);
+         free(dir->path);
+         dir->path = moved;
+      }
+   }
+   free(old_prefix);
+
+   return;
+} // END OF watch_renamed
+
+/* After the event queue overflowed: read again every watched directory whose
+ * mtime changed and report the differences from its remembered subdirectories */
+void watch_rescan(struct watch_set *ws, struct walk_ctx *ctx){
+   int cap = ws->cap; // directories found by this rescan are already current
+   int wd;
+
+   for(wd=0; wd<cap && wd<ws->cap; wd++){
+      struct watch_dir *dir = ws->dirs[wd];
+      struct name_list now = {NULL, 0, 0};
+      struct name_list gone = {NULL, 0, 0};
+      struct stat dirstat;
+      size_t pos;
+      int dir_fd;
+
+      if(dir == NULL || stat(dir->path, &dirstat) == -1 ||
+         dir->mtime_ns == dirstat.st_mtim.tv_sec * 1000000000LL + dirstat.st_mtim.tv_nsec){
+         continue;
+      }
+      dir_fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if(dir_fd == -1){
+         continue; // its parent reports it as removed
+      }
+      path_set(&ctx->path, dir->path);
+      if(read_subdirs(dir_fd, ctx, &now) == 0){
+         dir->mtime_ns = dirstat.st_mtim.tv_sec * 1000000000LL + dirstat.st_mtim.tv_nsec;
+         for(pos=0; pos<dir->subdirs.len; pos+=strlen(dir->subdirs.data + pos) + 1){
+            if(!name_list_has(&now, dir->subdirs.data + pos)){
+               name_list_add(&gone, dir->subdirs.data + pos);
+            }
+         }
+         for(pos=0; pos<gone.len; pos+=strlen(gone.data + pos) + 1){
+            watch_removed(ws, ctx, dir, gone.data + pos);
+         }
+         for(pos=0; pos<now.len; pos+=strlen(now.data + pos) + 1){
+            if(!name_list_has(&dir->subdirs, now.data + pos)){
+               watch_created(ctx, dir, now.data + pos);
+            }
+         }
+      }
+      close(dir_fd);
+      free(now.data);
+      free(gone.data);
+   }
+
+   return;
+} // END OF watch_rescan
+
+/* Stream subdirectory changes from the watches set up by the walk. Never returns
+ * unless reading the events fails. */
+void watch_loop(struct watch_set *ws, size_t dirbuf_size, const struct walk_opts *opts){
+   struct walk_ctx ctx;
+   char buf[WATCH_BUFSIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+   int move_wd = -1;          // the IN_MOVED_FROM half of a rename still waiting for its pair
+   uint32_t move_cookie = 0;
+   char *move_name = NULL;
 
-   if(startdir_ptr != NULL){
-      while( (currentdir_ptr = readdir(startdir_ptr)) != NULL){
-         char *dname     = currentdir_ptr->d_name;
-         int dname_len   = strlen(dname);
-         int dirname_len = strlen(dirname); 
-        
-         // Construct the full path to the directory currently being looked at 
-         char *name = malloc( (dname_len + dirname_len +1)*sizeof(char) );
-         strcpy(name, dirname);
-         strcat(name, dname); 
-         strcat(name, "/"); 
+   walk_init(&ctx, dirbuf_size, opts);
+   ctx.watch = ws;
+   fflush(stdout);
+
+   for(;;){
+      ssize_t nread = read(ws->fd, buf, sizeof(buf));
+      char *p;
+
+      if(nread == -1){
+         if(errno == EINTR){
+            continue;
+         }
+         fprintf(stderr, "lsdir: inotify: %s\n", strerror(errno));
+         break;
+      }
+
+      for(p=buf; p<buf+nread; p+=sizeof(struct inotify_event) + ((struct inotify_event *)p)->len){
+         struct inotify_event *ev = (struct inotify_event *)p;
+         struct watch_dir *dir = (ev->wd >= 0 && ev->wd < ws->cap) ? ws->dirs[ev->wd] : NULL;
+
+         if(ev->mask & IN_Q_OVERFLOW){
+            watch_rescan(ws, &ctx);
+            continue;
+         }
+         if(ev->mask & IN_IGNORED){
+            if(dir != NULL){
+               free(dir->path);
+               free(dir->subdirs.data);
+               free(dir);
+               ws->dirs[ev->wd] = NULL;
+            }
+            continue;
+         }
+         if(dir == NULL || !(ev->mask & IN_ISDIR) || ev->len == 0){
+            continue;
+         }
 
-         // Only output if the directory really is a directory and not a file 
-         if( (stat(name, &filestat) != -1) && S_ISDIR(filestat.st_mode) ){
-            // Get the directories under this directory if dir is not . or ..
-            if(strcmp(dname, ".") != 0 && strcmp(dname, "..") != 0 ) {
-               printf("%s\n", dname);
-               list_directories(name);
+         // A rename is an IN_MOVED_FROM followed by an IN_MOVED_TO with the same cookie.
+         // A lone IN_MOVED_FROM left the tree; a lone IN_MOVED_TO came into it.
+         if(move_name != NULL && !((ev->mask & IN_MOVED_TO) && ev->cookie == move_cookie)){
+            if(move_wd < ws->cap && ws->dirs[move_wd] != NULL){
+               watch_removed(ws, &ctx, ws->dirs[move_wd], move_name);
+            }
+            free(move_name);
+            move_name = NULL;
+         }
+         if(ev->mask & IN_MOVED_FROM){
+            move_wd = ev->wd;
+            move_cookie = ev->cookie;
+            move_name = strdup(ev->name);
+         }
+         else if(ev->mask & IN_MOVED_TO){
+            if(move_name != NULL && move_wd < ws->cap && ws->dirs[move_wd] != NULL){
+               watch_renamed(ws, &ctx, ws->dirs[move_wd], move_name, dir, ev->name);
+            }
+            else{
+               watch_created(&ctx, dir, ev->name);
             }
+            free(move_name);
+            move_name = NULL;
+         }
+         else if(ev->mask & IN_CREATE){
+            watch_created(&ctx, dir, ev->name);
          }
-         if(name){
-            free(name);
-            name = NULL;
+         else if(ev->mask & IN_DELETE){
+            watch_removed(ws, &ctx, dir, ev->name);
          }
       }
-      if(closedir(startdir_ptr) == -1){
-         fprintf(stderr, "lsdir: closedir: %s\n", strerror(errno));
+
+      // Give the other half of a rename a moment to arrive before calling it a removal
+      if(move_name != NULL){
+         struct pollfd pfd = {ws->fd, POLLIN, 0};
+
+         if(poll(&pfd, 1, MOVE_PAIR_WAIT_MS) > 0){
+            continue;
+         }
+         if(move_wd < ws->cap && ws->dirs[move_wd] != NULL){
+            watch_removed(ws, &ctx, ws->dirs[move_wd], move_name);
+         }
+         free(move_name);
+         move_name = NULL;
       }
+      fflush(stdout);
    }
-   else{
-      fprintf(stderr, "lsdir: %s: %s\n", dirname, strerror(errno));
-   }     
+   free(move_name);
+   walk_free(&ctx);
 
    return;
-} // END OF list_directories 
+} // END OF watch_loop
+
+/* A directory found in a -j walk, kept for --sorted output */
+struct dir_node {
+   char *name;
+   int hidden; // walked but above --mindepth, so not output
+   struct dir_node **children;
+   int child_cnt;
+   int child_cap;
+};
+
+/* A directory waiting to be listed in a -j walk */
+struct dir_work {
+   char *path;            // full path ending in '/'
+   struct dir_node *node; // where to record its subdirectories, or NULL when unsorted
+   int depth;             // levels below the directory given
+};
+
+/* One thread's deque of directories. The owner pushes and pops at the tail; other
+ * threads steal from the head, so they take the oldest (shallowest) directories. */
+struct work_deque {
+   pthread_mutex_t lock;
+   struct dir_work *items;
+   size_t head;
+   size_t tail;
+   size_t cap;
+};
+
+/* State shared by the threads of a -j walk */
+struct walk_pool {
+   struct work_deque deques[MAX_JOBS];
+   int job_cnt;
+   long pending;               // directories pushed but not yet listed
+   long queued;                // directories sitting in a deque
+   int sleepers;               // threads waiting on idle_cond for work
+   pthread_mutex_t idle_lock;
+   pthread_cond_t idle_cond;   // signalled on a push, broadcast when pending reaches 0
+   pthread_mutex_t out_lock;   // keeps each thread's buffer together on stdout
+   const struct walk_opts *opts;
+   dev_t root_dev;
+   size_t root_len;            // length of the path of the directory given
+   pthread_mutex_t visited_lock;
+   struct visited_set visited; // directories listed by any thread
+};
+
+/* Arguments of one walk thread */
+struct walk_thread {
+   struct walk_pool *pool;
+   int id;
+   struct dir_reader reader;
+   size_t out_len;
+   char out[THREAD_OUT_BUFSIZE];
+};
+
+/* Add a directory to the tail of thread id's deque and wake one idle thread */
+void deque_push(struct walk_pool *pool, int id, struct dir_work work){
+   struct work_deque *dq = &pool->deques[id];
+
+   pthread_mutex_lock(&dq->lock);
+   if(dq->tail == dq->cap){
+      // Reuse the room left by steals before growing
+      if(dq->head > 0){
+         memmove(dq->items, dq->items + dq->head, (dq->tail - dq->head) * sizeof(struct dir_work));
+         dq->tail -= dq->head;
+         dq->head = 0;
+      }
+      if(dq->tail == dq->cap){
+         dq->cap = dq->cap ? dq->cap * 2 : 64;
+         dq->items = realloc(dq->items, dq->cap * sizeof(struct dir_work));
+         if(dq->items == NULL){
+            fprintf(stderr, "lsdir: %s\n", strerror(errno));
+            exit(1);
+         }
+      }
+   }
+   dq->items[dq->tail++] = work;
+   pthread_mutex_unlock(&dq->lock);
+
+   // A thread about to sleep either sees the new count or is counted as a sleeper
+   __atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+   if(__atomic_load_n(&pool->sleepers, __ATOMIC_SEQ_CST) > 0){
+      pthread_mutex_lock(&pool->idle_lock);
+      pthread_cond_signal(&pool->idle_cond);
+      pthread_mutex_unlock(&pool->idle_lock);
+   }
+
+   return;
+} // END OF deque_push
+
+/* Take a directory from the tail (owner) or head (thief) of a deque.
+ * Returns 1 if one was taken. */
+int deque_take(struct work_deque *dq, struct dir_work *work, int steal){
+   int taken = 0;
+
+   pthread_mutex_lock(&dq->lock);
+   if(dq->head < dq->tail){
+      *work = steal ? dq->items[dq->head++] : dq->items[--dq->tail];
+      taken = 1;
+      if(dq->head == dq->tail){
+         dq->head = dq->tail = 0;
+      }
+   }
+   pthread_mutex_unlock(&dq->lock);
+
+   return(taken);
+} // END OF deque_take
+
+/* Write out a thread's buffered names */
+void thread_out_flush(struct walk_thread *self){
+   size_t done = 0;
+
+   pthread_mutex_lock(&self->pool->out_lock);
+   while(done < self->out_len){
+      ssize_t nwritten = write(STDOUT_FILENO, self->out + done, self->out_len - done);
+
+      if(nwritten == -1){
+         if(errno == EINTR){
+            continue;
+         }
+         fprintf(stderr, "lsdir: write: %s\n", strerror(errno));
+         exit(1);
+      }
+      done += nwritten;
+   }
+   pthread_mutex_unlock(&self->pool->out_lock);
+   self->out_len = 0;
+
+   return;
+} // END OF thread_out_flush
+
+/* Add a name and a newline to a thread's output buffer */
+void thread_out_name(struct walk_thread *self, const char *name){
+   size_t name_len = strlen(name);
+
+   if(self->out_len + name_len + 1 > THREAD_OUT_BUFSIZE){
+      thread_out_flush(self);
+   }
+   // A name longer than the buffer is written through on its own
+   if(name_len + 1 > THREAD_OUT_BUFSIZE){
+      pthread_mutex_lock(&self->pool->out_lock);
+      if(write(STDOUT_FILENO, name, name_len) == -1 || write(STDOUT_FILENO, "\n", 1) == -1){
+         fprintf(stderr, "lsdir: write: %s\n", strerror(errno));
+      }
+      pthread_mutex_unlock(&self->pool->out_lock);
+      return;
+   }
+   memcpy(self->out + self->out_len, name, name_len);
+   self->out[self->out_len + name_len] = '\n';
+   self->out_len += name_len + 1;
+
+   return;
+} // END OF thread_out_name
+
+/* List one directory of a -j walk: output (or record) each subdirectory and push
+ * it onto this thread's deque */
+void list_work(struct walk_thread *self, struct dir_work *work){
+   struct walk_pool *pool = self->pool;
+   size_t path_len = strlen(work->path);
+   struct linux_dirent64 *currentdir_ptr;
+   struct stat dirstat;
+   int state;
+   int dir_fd = open_dir_path(work->path);
+
+   if(dir_fd == -1 || fstat(dir_fd, &dirstat) == -1){
+      fprintf(stderr, "lsdir: %s: %s\n", work->path, strerror(errno));
+      if(dir_fd != -1){
+         close(dir_fd);
+      }
+      return;
+   }
+   // A mount point under -x, or a directory some thread already listed, was
+   // output by its parent but is not listed again
+   state = VISIT_DONE;
+   if(!pool->opts->one_fs || dirstat.st_dev == pool->root_dev){
+      pthread_mutex_lock(&pool->visited_lock);
+      state = visited_enter(&pool->visited, dirstat.st_dev, dirstat.st_ino);
+      pthread_mutex_unlock(&pool->visited_lock);
+   }
+   if(state != VISIT_EMPTY){
+      close(dir_fd);
+      return;
+   }
+
+   reader_start(&self->reader, dir_fd);
+   while( (currentdir_ptr = reader_next(&self->reader)) != NULL){
+      char *dname = currentdir_ptr->d_name;
+      size_t dname_len;
+      struct dir_work child;
+      int action;
+
+      if(is_dot_entry(dname) || !entry_is_dir(dir_fd, currentdir_ptr, pool->opts->follow)){
+         continue;
+      }
+
+      dname_len = strlen(dname);
+      child.path = malloc(path_len + dname_len + 2);
+      if(child.path == NULL){
+         fprintf(stderr, "lsdir: %s\n", strerror(errno));
+         exit(1);
+      }
+      memcpy(child.path, work->path, path_len);
+      memcpy(child.path + path_len, dname, dname_len);
+      child.path[path_len + dname_len] = '/';
+      child.path[path_len + dname_len + 1] = '\0';
+      child.node = NULL;
+      child.depth = work->depth + 1;
+
+      if(pool->opts->exclude_cnt > 0 &&
+         walk_excluded(pool->opts, dname, child.path + pool->root_len, path_len + dname_len - pool->root_len)){
+         free(child.path);
+         continue;
+      }
+      action = walk_action(pool->opts, dname, child.depth);
+
+      if(work->node != NULL){
+         struct dir_node *parent = work->node;
+
+         child.node = calloc(1, sizeof(struct dir_node));
+         if(child.node == NULL || (child.node->name = strdup(dname)) == NULL){
+            fprintf(stderr, "lsdir: %s\n", strerror(errno));
+            exit(1);
+         }
+         child.node->hidden = !(action & WALK_SHOW);
+         if(parent->child_cnt == parent->child_cap){
+            parent->child_cap = parent->child_cap ? parent->child_cap * 2 : 8;
+            parent->children = realloc(parent->children, parent->child_cap * sizeof(struct dir_node *));
+            if(parent->children == NULL){
+               fprintf(stderr, "lsdir: %s\n", strerror(errno));
+               exit(1);
+            }
+         }
+         parent->children[parent->child_cnt++] = child.node;
+      }
+      else if(action & WALK_SHOW){
+         thread_out_name(self, dname);
+      }
+
+      if(!(action & WALK_DESCEND)){
+         free(child.path);
+         continue;
+      }
+      __atomic_add_fetch(&pool->pending, 1, __ATOMIC_RELAXED);
+      deque_push(pool, self->id, child);
+   }
+   if(self->reader.error){
+      fprintf(stderr, "lsdir: %s: %s\n", work->path, strerror(self->reader.error));
+   }
+   if(close(dir_fd) == -1){
+      fprintf(stderr, "lsdir: close: %s\n", strerror(errno));
+   }
+
+   return;
+} // END OF list_work
+
+/* Walk thread: list directories from its own deque, stealing from the others
+ * when it runs dry, until no directory is pending anywhere */
+void *walk_thread_main(void *arg){
+   struct walk_thread *self = arg;
+   struct walk_pool *pool = self->pool;
+   struct dir_work work;
+
+   while(__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) > 0){
+      int found = deque_take(&pool->deques[self->id], &work, 0);
+      int i;
+
+      for(i=1; !found && i<pool->job_cnt; i++){
+         found = deque_take(&pool->deques[(self->id + i) % pool->job_cnt], &work, 1);
+      }
+      if(!found){
+         // Someone is still listing a directory that may add more work:
+         // sleep until a push or the end of the walk
+         pthread_mutex_lock(&pool->idle_lock);
+         __atomic_add_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+         while(__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0 &&
+               __atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) > 0){
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+         }
+         __atomic_sub_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+         pthread_mutex_unlock(&pool->idle_lock);
+         continue;
+      }
+      __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+
+      list_work(self, &work);
+      free(work.path);
+      if(__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST) == 0){
+         pthread_mutex_lock(&pool->idle_lock);
+         pthread_cond_broadcast(&pool->idle_cond);
+         pthread_mutex_unlock(&pool->idle_lock);
+      }
+   }
+   thread_out_flush(self);
+
+   return(NULL);
+} // END OF walk_thread_main
+
+/* qsort comparator for --sorted: directory nodes by name */
+int compare_node_name(const void *a, const void *b){
+   return(strcmp((*(struct dir_node * const *)a)->name, (*(struct dir_node * const *)b)->name));
+} // END OF compare_node_name
+
+/* A node of the tree being printed by print_sorted, and its next child */
+struct sorted_frame {
+   struct dir_node *node;
+   int pos;
+};
+
+/* Print the subdirectories of root depth first, sorted by name, and free them.
+ * Keeps its own stack, so the depth of the tree does not matter. */
+void print_sorted(struct dir_node *root){
+   struct sorted_frame *stack = NULL;
+   int stack_cap = 0;
+   int depth = 0;
+   struct dir_node *node = root;
+
+   while(node != NULL){
+      if(depth == stack_cap){
+         stack_cap = stack_cap ? stack_cap * 2 : 64;
+         stack = realloc(stack, stack_cap * sizeof(struct sorted_frame));
+         if(stack == NULL){
+            fprintf(stderr, "lsdir: %s\n", strerror(errno));
+            exit(1);
+         }
+      }
+      if(node->child_cnt > 1){
+         qsort(node->children, node->child_cnt, sizeof(struct dir_node *), compare_node_name);
+      }
+      stack[depth].node = node;
+      stack[depth].pos = 0;
+      depth++;
+
+      // Go back up past every node whose children are done, then on to the next child
+      node = NULL;
+      while(depth > 0 && node == NULL){
+         struct sorted_frame *top = &stack[depth - 1];
+
+         if(top->pos < top->node->child_cnt){
+            node = top->node->children[top->pos++];
+            if(!node->hidden){
+               printf("%s\n", node->name);
+            }
+            continue;
+         }
+         free(top->node->children);
+         if(top->node != root){
+            free(top->node->name);
+            free(top->node);
+         }
+         depth--;
+      }
+   }
+   free(stack);
+
+   return;
+} // END OF print_sorted
+
+/* List a tree with job_cnt threads, each taking directories from its own deque
+ * and stealing from the others when it runs dry. Names go out through per-thread
+ * buffers, or with sorted into a tree that is printed once the walk is done.
+ * ARG dirname: the directory whose subdirectories should be output, ending in '/'
+ * ARG job_cnt: number of threads to list directories with
+ * ARG sorted: print the tree sorted once the walk is done
+ * ARG dirbuf_size: bytes of directory entries each thread reads at a time
+ * ARG opts: how to walk the tree */
+void list_directories_parallel(char *dirname, int job_cnt, int sorted, size_t dirbuf_size, const struct walk_opts *opts){
+   struct walk_pool *pool = calloc(1, sizeof(struct walk_pool));
+   struct walk_thread *threads = calloc(job_cnt, sizeof(struct walk_thread));
+   pthread_t tids[MAX_JOBS];
+   struct dir_node root = {NULL, 0, NULL, 0, 0};
+   struct dir_work first;
+   struct stat rootstat;
+   int started;
+   int i;
+
+   if(pool == NULL || threads == NULL || (first.path = strdup(dirname)) == NULL){
+      fprintf(stderr, "lsdir: %s\n", strerror(errno));
+      exit(1);
+   }
+   first.node = sorted ? &root : NULL;
+   first.depth = 0;
+   if(opts->maxdepth == 0){
+      free(first.path);
+      free(threads);
+      free(pool);
+      return;
+   }
+   pool->job_cnt = job_cnt;
+   pool->opts = opts;
+   pool->root_len = strlen(dirname);
+   pool->root_dev = (stat(dirname, &rootstat) == 0) ? rootstat.st_dev : 0;
+   pthread_mutex_init(&pool->out_lock, NULL);
+   pthread_mutex_init(&pool->visited_lock, NULL);
+   pthread_mutex_init(&pool->idle_lock, NULL);
+   pthread_cond_init(&pool->idle_cond, NULL);
+   for(i=0; i<job_cnt; i++){
+      pthread_mutex_init(&pool->deques[i].lock, NULL);
+   }
+   pool->pending = 1;
+   deque_push(pool, 0, first);
+
+   // Anything printed earlier must come out before the threads write
+   fflush(stdout);
+   for(i=0; i<job_cnt; i++){
+      threads[i].pool = pool;
+      threads[i].id = i;
+      reader_init(&threads[i].reader, dirbuf_size);
+   }
+   for(started=0; started<job_cnt; started++){
+      if(pthread_create(&tids[started], NULL, walk_thread_main, &threads[started]) != 0){
+         break;
+      }
+   }
+   if(started == 0){
+      // No threads at all: do the walk on this one
+      walk_thread_main(&threads[0]);
+   }
+   for(i=0; i<started; i++){
+      pthread_join(tids[i], NULL);
+   }
+
+   if(sorted){
+      print_sorted(&root);
+   }
+   for(i=0; i<job_cnt; i++){
+      free(threads[i].reader.buf);
+      free(pool->deques[i].items);
+      pthread_mutex_destroy(&pool->deques[i].lock);
+   }
+   pthread_mutex_destroy(&pool->out_lock);
+   pthread_mutex_destroy(&pool->visited_lock);
+   pthread_mutex_destroy(&pool->idle_lock);
+   pthread_cond_destroy(&pool->idle_cond);
+   free(pool->visited.slots);
+   free(threads);
+   free(pool);
+
+   return;
+} // END OF list_directories_parallel
+
+/* Parse a byte count with an optional K or M suffix. Returns -1 if invalid. */
+long long parse_size(const char *str){
+   char *end;
+   long long size = strtoll(str, &end, 10);
+
+   if(end == str || size < 0){
+      return(-1);
+   }
+   switch(*end){
+      case 'K': case 'k':
+         size <<= 10;
+         end++;
+         break;
+      case 'M': case 'm':
+         size <<= 20;
+         end++;
+         break;
+   }
+
+   return(*end == '\0' ? size : -1);
+} // END OF parse_size
+
+/* If argv[*i] is the option name, given as "NAME VALUE" or "NAME=VALUE", return
+ * its value (moving *i past it), else NULL */
+char *option_value(int argc, char *argv[], int *i, const char *name){
+   size_t name_len = strlen(name);
+
+   if(strncmp(argv[*i], name, name_len) != 0){
+      return(NULL);
+   }
+   if(argv[*i][name_len] == '='){
+      return(argv[*i] + name_len + 1);
+   }
+   if(argv[*i][name_len] == '\0' && *i + 1 < argc){
+      return(argv[++*i]);
+   }
+
+   return(NULL);
+} // END OF option_value
 
+/* Parse a --maxdepth or --mindepth value. Returns -1 if invalid. */
+int parse_depth(const char *str){
+   char *end;
+   long depth = strtol(str, &end, 10);
+
+   if(end == str || *end != '\0' || depth < 0 || depth > INT_MAX){
+      return(-1);
+   }
 
+   return((int)depth);
+} // END OF parse_depth
 
 int main(int argc, char *argv[]){
+   char **dirnames = malloc(argc * sizeof(char *)); // the directory arguments, in order
+   int dir_cnt = 0;
+   int job_cnt = 1;
+   int sorted = 0;
+   long long dirbuf_size = DEFAULT_DIRBUF_SIZE;
+   char *snapshot_name = NULL;
+   struct snapshot snap;
+   struct watch_set watch = {-1, NULL, 0, 0};
+   int watch_flag = 0;
+   struct walk_opts opts = {0, 0, INT_MAX, 0, NULL, 0, 0, NULL, 0};
+   char *value;
+   int i;
+
+   opts.excludes = malloc(argc * sizeof(struct glob));
+   opts.prunes = malloc(argc * sizeof(struct glob));
+   if(dirnames == NULL || opts.excludes == NULL || opts.prunes == NULL){
+      fprintf(stderr, "lsdir: %s\n", strerror(errno));
+      return(1);
+   }
+
+   // Separate the options from the directories
+   for(i=1; i<argc; i++){
+      if(strncmp(argv[i], "-j", 2) == 0){
+         char *value = argv[i] + 2;
+
+         if(*value == '\0' && i + 1 < argc){
+            value = argv[++i];
+         }
+         job_cnt = atoi(value);
+         if(job_cnt < 1 || job_cnt > MAX_JOBS){
+            fprintf(stderr, "lsdir: invalid number of jobs: '%s'\n", value);
+            return(1);
+         }
+      }
+      else if( (value = option_value(argc, argv, &i, "--maxdepth")) != NULL){
+         opts.maxdepth = parse_depth(value);
+         if(opts.maxdepth < 0){
+            fprintf(stderr, "lsdir: invalid depth: '%s'\n", value);
+            return(1);
+         }
+      }
+      else if( (value = option_value(argc, argv, &i, "--mindepth")) != NULL){
+         opts.mindepth = parse_depth(value);
+         if(opts.mindepth < 0){
+            fprintf(stderr, "lsdir: invalid depth: '%s'\n", value);
+            return(1);
+         }
+      }
+      else if( (value = option_value(argc, argv, &i, "--exclude")) != NULL){
+         glob_compile(&opts.excludes[opts.exclude_cnt], value);
+         opts.path_exclude_cnt += opts.excludes[opts.exclude_cnt++].is_path;
+      }
+      else if( (value = option_value(argc, argv, &i, "--prune-name")) != NULL){
+         if(strchr(value, '/') != NULL){
+            fprintf(stderr, "lsdir: --prune-name takes a name, not a path: '%s'\n", value);
+            return(1);
+         }
+         glob_compile(&opts.prunes[opts.prune_cnt++], value);
+      }
+      else if(strcmp(argv[i], "-L") == 0){
+         opts.follow = 1;
+      }
+      else if(strcmp(argv[i], "-x") == 0){
+         opts.one_fs = 1;
+      }
+      else if(strcmp(argv[i], "--sorted") == 0){
+         sorted = 1;
+      }
+      else if(strncmp(argv[i], "--dirbuf=", 9) == 0){
+         dirbuf_size = parse_size(argv[i] + 9);
+         if(dirbuf_size < MIN_DIRBUF_SIZE || dirbuf_size > (1LL << 30)){
+            fprintf(stderr, "lsdir: invalid directory buffer size: '%s' (%d to 1G)\n", argv[i] + 9, MIN_DIRBUF_SIZE);
+            return(1);
+         }
+      }
+      else if(strncmp(argv[i], "--snapshot=", 11) == 0 && argv[i][11] != '\0'){
+         snapshot_name = argv[i] + 11;
+      }
+      else if(strcmp(argv[i], "--watch") == 0){
+         watch_flag = 1;
+      }
+      else{
+         dirnames[dir_cnt++] = argv[i];
+      }
+   }
+   if(sorted && opts.follow){
+      // Which of several links to a directory gets to list it depends on thread timing
+      fprintf(stderr, "lsdir: --sorted cannot be combined with -L\n");
+      return(1);
+   }
+   if(watch_flag){
+      if(job_cnt > 1 || sorted){
+         fprintf(stderr, "lsdir: --watch cannot be combined with -j or --sorted\n");
+         return(1);
+      }
+      watch.fd = inotify_init1(IN_CLOEXEC);
+      if(watch.fd == -1){
+         fprintf(stderr, "lsdir: inotify: %s\n", strerror(errno));
+         return(1);
+      }
+   }
+   if(snapshot_name != NULL){
+      if(job_cnt > 1 || sorted){
+         fprintf(stderr, "lsdir: --snapshot cannot be combined with -j or --sorted\n");
+         return(1);
+      }
+      snapshot_load(&snap, snapshot_name);
+   }
 
    // Get the directories to recursively list the subdirectories for 
-   if(argc>1){
-      int i;
-      for(i=1; i<argc; i++){
-         char *filename = argv[i];
-         int filename_len = strlen(argv[i]);
+   if(dir_cnt>0){
+      for(i=0; i<dir_cnt; i++){
+         char *filename = dirnames[i];
+         int filename_len = strlen(dirnames[i]);
 
          // Append a '/' to the end of the dir 
          if(filename[filename_len - 1] != '/'){
             // Prepend the current dir to filenames if they do not already have an absolute or relative path 
             if( (*filename != '/') && (*filename != '.' && *(filename++) != '/') ){
-               filename = (char *)malloc((filename_len + 3)*sizeof(char));
+               filename = (char *)malloc((filename_len + 4)*sizeof(char));
                strcpy(filename, "./");
-               strcat(filename, argv[i]);
+               strcat(filename, dirnames[i]);
                strcat(filename, "/");
             }
             // Do not prepend the current dir since an absolute or relative path is already given
             else{
-               filename = (char *)malloc((filename_len + 1)*sizeof(char));
-               strcpy(filename, argv[i]);
+               filename = (char *)malloc((filename_len + 2)*sizeof(char));
+               strcpy(filename, dirnames[i]);
                strcat(filename, "/");
             }
          }
@@ -95,18 +2301,23 @@ int main(int argc, char *argv[]){
          else{
             // Prepend the current dir to filenames if they do not already have an absolute or relative path 
             if( (*filename != '/') && (*filename != '.' && *(filename++) != '/') ){
-               filename = (char *)malloc((filename_len + 2)*sizeof(char));
+               filename = (char *)malloc((filename_len + 3)*sizeof(char));
                strcpy(filename, "./");
-               strcat(filename, argv[i]);
+               strcat(filename, dirnames[i]);
             }
             // Do not prepend the current dir since an absolute or relative path is already given
             else{
-               filename = (char *)malloc(filename_len*sizeof(char));
-               strcpy(filename, argv[i]);
+               filename = (char *)malloc((filename_len + 1)*sizeof(char));
+               strcpy(filename, dirnames[i]);
             }
          }
 
-         list_directories(filename);
+         if(job_cnt > 1 || sorted){
+            list_directories_parallel(filename, job_cnt, sorted, dirbuf_size, &opts);
+         }
+         else{
+            list_directories(filename, dirbuf_size, &opts, snapshot_name ? &snap : NULL, watch_flag ? &watch : NULL);
+         }
 
          if(filename){
             free(filename);
@@ -115,9 +2326,29 @@ int main(int argc, char *argv[]){
       }
    }
    // Else list the subdirectories for the current working directory 
+   else if(job_cnt > 1 || sorted){
+      list_directories_parallel("./", job_cnt, sorted, dirbuf_size, &opts);
+   }
    else{
-      list_directories("./");
+      list_directories("./", dirbuf_size, &opts, snapshot_name ? &snap : NULL, watch_flag ? &watch : NULL);
+   }
+   if(snapshot_name != NULL){
+      snapshot_save(&snap, snapshot_name);
+   }
+   if(watch_flag){
+      watch_loop(&watch, dirbuf_size, &opts);
+   }
+   for(i=0; i<opts.exclude_cnt; i++){
+      free(opts.excludes[i].tokens);
+      free(opts.excludes[i].text);
+   }
+   for(i=0; i<opts.prune_cnt; i++){
+      free(opts.prunes[i].tokens);
+      free(opts.prunes[i].text);
    }
+   free(opts.excludes);
+   free(opts.prunes);
+   free(dirnames);
   
    return(0);
 } // END OF main
@@ -3,58 +3,1204 @@
 *
 * INPUT: 
 *     (OPTIONAL) STRING: The name of the file to perform the word/line/byte counts on. 
+*     (OPTIONAL) -m: Count UTF-8 characters. -L: Print the longest line length in characters.
+*     (OPTIONAL) -f: After the first count, keep following the files and print their
+*                updated counts as data is appended, counting only the new bytes.
+*     (OPTIONAL) --io=mmap|read|stdio: How input is read. Regular files are memory mapped
+*                by default; pipes and stdin always fall back to read().
+*     (OPTIONAL) --threads N: Split each regular file into N byte ranges and count them
+*                in parallel with pread().
+*     (OPTIONAL) --cache[=FILE]: Remember the counts of regular files in FILE (default
+*                ~/.mywc_cache), keyed on device, inode, size, and mtime, and reuse
+*                them for files that have not changed since.
+*                The file grows to at most CACHE_MAX_SLOTS entries (80 MiB); past
+*                that, a new file replaces the entry in the slot it hashes to.
+*                An existing FILE that is not a cache is never overwritten.
+*     (OPTIONAL) --cache-stats: Print cache hits and misses to stderr. Implies --cache.
+*     (OPTIONAL) --batch: Count all files up front with many opens and reads in flight
+*                through io_uring (or a thread pool where io_uring is unavailable).
+*                Output is still in argument order.
+*     (OPTIONAL) --files0-from=F: Also count the NUL-separated file names read from F
+*                ("-" for stdin). Implies --batch.
 *
-* OUTPUT: The same as Unix's wc command for the c, l, and w options for 0+ files. 
+* OUTPUT: The same as Unix's wc command for the c, l, w, m, and L options for 0+ files. 
 *
 * DESCRIPTION: Simulate Unix's wc command with the c, l, and w options for 0+ files. 
+*              Counting is done by the wc_count library:
+*                 gcc -O2 -pthread mywc.c wc_count.c -o mywc
 *********************************************************/
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 
-int stats_arr[3] = {0, 0, 0}; // Holds line, word, and byte counts to return
+#include "wc_count.h"
 
-/* Calculate the number of lines, bytes, and words in the file or stdin */
-void calculate_file_counts(FILE *stream){
-   char c = '0';
-   int prevchar = 0;
-   int line_cnt = 0;
-   int word_cnt = 0;
-   int byte_cnt = 0;
+#define READ_BUFSIZE (1 << 20) // Bytes requested from read() per call
+#define MIN_CHUNK (8 << 20) // Smallest byte range worth handing to its own thread
+#define MAX_THREADS 1024
+#define BATCH_DEPTH 64 // Files in flight at once in --batch mode
+#define BATCH_BUFSIZE (64 << 10) // Read size per file in --batch mode
+#define BATCH_THREADS 16 // Threads used by --batch when io_uring is unavailable
+#define CACHE_VERSION 1
+#define CACHE_MIN_SLOTS 4096 // Slots in a new cache file; always a power of 2
+#define CACHE_MAX_SLOTS (1 << 20) // The cache stops growing here (80 MiB) and evicts instead
 
-   while( (c=getc(stream)) != EOF){
-      byte_cnt += sizeof(c);
+enum io_mode { IO_MMAP, IO_READ, IO_STDIO };
 
-      if(c == '\n'){
-         line_cnt++;
+/* Columns printed for each file, in output order */
+enum show_mask { SHOW_LINES = 0x1, SHOW_WORDS = 0x2, SHOW_CHARS = 0x4, SHOW_BYTES = 0x8, SHOW_MAX_LINE = 0x10 };
 
-         if(prevchar){
-            word_cnt++;
-            prevchar = 0;
+enum io_mode io_mode = IO_MMAP; // Input path selected with --io
+int thread_cnt = 1; // Threads used per regular file, set with --threads
+unsigned int count_flags = 0; // WC_* counts requested with -m and -L
+
+/* Start of the --cache file */
+struct cache_header {
+   char magic[8];             // "MYWCACHE"
+   unsigned int version;      // CACHE_VERSION
+   unsigned int slot_cnt;     // Number of cache_entry slots that follow the header
+   unsigned long long used_cnt;
+};
+
+/* One file's counts. Slots are found by hashing (dev, ino); size and mtime_ns tell
+ * whether the counts are still valid for the file now at that inode. */
+struct cache_entry {
+   unsigned long long dev;
+   unsigned long long ino;
+   long long size;
+   long long mtime_ns;
+   unsigned int flags; // WC_* counts stored in counts
+   unsigned int used;
+   struct wc_counts counts;
+};
+
+/* The open --cache file, mapped MAP_SHARED so updates go straight back to disk */
+struct count_cache {
+   int fd;
+   struct cache_header *hdr;
+   struct cache_entry *slots;
+   size_t map_len;
+   unsigned int slot_cnt; // slots in this process's mapping
+   long long hits;
+   long long misses;
+};
+
+struct count_cache cache = {-1, NULL, NULL, 0, 0, 0, 0};
+
+/* One byte range of a file counted by one thread */
+struct count_chunk {
+   int fd;
+   off_t start;
+   off_t end;
+   struct wc_state st;
+   int error; // errno from pread, or 0
+};
+
+/* Count a regular file through a read-only mapping. Returns 0, or -1 if the file could
+ * not be mapped so the caller can fall back to read(). */
+static int count_mapped(int fd, off_t size, struct wc_state *st){
+   unsigned char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+   if(map == MAP_FAILED){
+      return(-1);
+   }
+
+   // Hints only, so failures (e.g. no THP support for this filesystem) are ignored
+   madvise(map, size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+   madvise(map, size, MADV_HUGEPAGE);
+#endif
+
+   wc_feed(st, map, size);
+   munmap(map, size);
+
+   return(0);
+} // END OF count_mapped
+
+/* Count the stream through a stdio FILE, the way mywc used to read its input */
+static void count_stdio(int fd, unsigned char *buf, struct wc_state *st){
+   size_t nread;
+   FILE *stream = (fd == STDIN_FILENO) ? stdin : fdopen(dup(fd), "r");
+
+   if(stream == NULL){
+      fprintf(stderr, "mywc: %s\n", strerror(errno));
+      return;
+   }
+   while( (nread = fread(buf, 1, READ_BUFSIZE, stream)) != 0){
+      wc_feed(st, buf, nread);
+   }
+   if(ferror(stream)){
+      fprintf(stderr, "mywc: read: %s\n", strerror(errno));
+   }
+   if(stream != stdin){
+      fclose(stream);
+   }
+
+   return;
+} // END OF count_stdio
+
+/* Thread body: count one byte range with pread into the range's own wc_state */
+static void * count_chunk_thread(void *arg){
+   struct count_chunk *chunk = arg;
+   off_t offset = chunk->start;
+   ssize_t nread;
+
+   unsigned char *buf = malloc(READ_BUFSIZE);
+   if(buf == NULL){
+      chunk->error = errno;
+      return(NULL);
+   }
+
+   while(offset < chunk->end){
+      size_t want = (chunk->end - offset < READ_BUFSIZE) ? (size_t)(chunk->end - offset) : READ_BUFSIZE;
+
+      nread = pread(chunk->fd, buf, want, offset);
+      if(nread == -1){
+         if(errno == EINTR){
+            continue;
          }
+         chunk->error = errno;
+         break;
+      }
+      // The file shrank underneath us
+      if(nread == 0){
+         break;
+      }
+      wc_feed(&chunk->st, buf, nread);
+      offset += nread;
+   }
+   free(buf);
+
+   return(NULL);
+} // END OF count_chunk_thread
+
+/* Count a regular file of the given size as nthreads parallel byte ranges, then
+ * merge the per-range counts into st in file order */
+static void count_threaded(int fd, off_t size, int nthreads, struct wc_state *st){
+   struct count_chunk *chunks = calloc(nthreads, sizeof(struct count_chunk));
+   pthread_t *tids = malloc(nthreads * sizeof(pthread_t));
+   int i;
+
+   if(chunks == NULL || tids == NULL){
+      fprintf(stderr, "mywc: %s\n", strerror(errno));
+      exit(1);
+   }
+
+   for(i=0; i<nthreads; i++){
+      chunks[i].fd = fd;
+      chunks[i].start = size / nthreads * i;
+      chunks[i].end = (i == nthreads - 1) ? size : size / nthreads * (i + 1);
+      wc_init(&chunks[i].st, count_flags);
+
+      if(pthread_create(&tids[i], NULL, count_chunk_thread, &chunks[i]) != 0){
+         // Count this range on the calling thread instead
+         count_chunk_thread(&chunks[i]);
+         tids[i] = 0;
+      }
+   }
+
+   for(i=0; i<nthreads; i++){
+      if(tids[i]){
+         pthread_join(tids[i], NULL);
+      }
+      if(chunks[i].error){
+         fprintf(stderr, "mywc: read: %s\n", strerror(chunks[i].error));
+      }
+      wc_merge(st, &chunks[i].st);
+   }
+   free(chunks);
+   free(tids);
+
+   return;
+} // END OF count_threaded
+
+/* Feed everything from the current offset of fd to EOF into st */
+static void count_fd(int fd, struct wc_state *st){
+   struct stat filestat;
+   int counted = 0;
+   ssize_t nread;
+   unsigned char *buf;
+
+   // Threads and mmap count the file by position from byte 0, so they are only
+   // used while fd is still at its start; otherwise the read loop picks up from
+   // the current offset as plain read() would
+   if(lseek(fd, 0, SEEK_CUR) == 0 && fstat(fd, &filestat) == 0 && S_ISREG(filestat.st_mode) && filestat.st_size > 0){
+      int nthreads = thread_cnt;
+
+      // Keep every range at least MIN_CHUNK bytes so thread startup stays negligible
+      if(filestat.st_size / MIN_CHUNK < nthreads){
+         nthreads = filestat.st_size / MIN_CHUNK;
+      }
+
+      if(nthreads > 1){
+         count_threaded(fd, filestat.st_size, nthreads, st);
+         counted = 1;
       }
-      else if(c == ' '){
-         if(prevchar){
-            word_cnt++;
-            prevchar = 0;
+      // Map regular files; anything else (pipes, ttys, empty files) is streamed
+      else if(io_mode == IO_MMAP){
+         counted = (count_mapped(fd, filestat.st_size, st) == 0);
+      }
+      // Leave fd at the end, where the read loop would have left it
+      if(counted){
+         lseek(fd, filestat.st_size, SEEK_SET);
+      }
+   }
+
+   if(!counted){
+      buf = malloc(READ_BUFSIZE);
+      if(buf == NULL){
+         fprintf(stderr, "mywc: %s\n", strerror(errno));
+         exit(1);
+      }
+
+      if(io_mode == IO_STDIO){
+         count_stdio(fd, buf, st);
+      }
+      else{
+         while( (nread = read(fd, buf, READ_BUFSIZE)) != 0){
+            if(nread == -1){
+               if(errno == EINTR){
+                  continue;
+               }
+               fprintf(stderr, "mywc: read: %s\n", strerror(errno));
+               break;
+            }
+            wc_feed(st, buf, nread);
          }
       }
+      free(buf);
+   }
+
+   return;
+} // END OF count_fd
+
+/* Map a cache file with slot_cnt slots, formatting it first if fresh is set */
+static int cache_map(struct count_cache *c, unsigned int slot_cnt, int fresh){
+   c->map_len = sizeof(struct cache_header) + (size_t)slot_cnt * sizeof(struct cache_entry);
+
+   if(fresh && (ftruncate(c->fd, 0) == -1 || ftruncate(c->fd, c->map_len) == -1)){
+      return(-1);
+   }
+   c->hdr = mmap(NULL, c->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, 0);
+   if(c->hdr == MAP_FAILED){
+      c->hdr = NULL;
+      return(-1);
+   }
+   c->slots = (struct cache_entry *)(c->hdr + 1);
+   c->slot_cnt = slot_cnt;
+
+   if(fresh){
+      memcpy(c->hdr->magic, "MYWCACHE", 8);
+      c->hdr->version = CACHE_VERSION;
+      c->hdr->slot_cnt = slot_cnt;
+      c->hdr->used_cnt = 0;
+   }
+
+   return(0);
+} // END OF cache_map
+
+/* Whether the cache file holds a valid header for a table of its size. Returns
+ * the slot count, or 0. */
+static unsigned int cache_valid(int fd){
+   struct stat filestat;
+   struct cache_header hdr;
+
+   if(fstat(fd, &filestat) == 0 && pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+      memcmp(hdr.magic, "MYWCACHE", 8) == 0 && hdr.version == CACHE_VERSION &&
+      hdr.slot_cnt >= CACHE_MIN_SLOTS && hdr.slot_cnt <= CACHE_MAX_SLOTS && (hdr.slot_cnt & (hdr.slot_cnt - 1)) == 0 &&
+      (size_t)filestat.st_size == sizeof(hdr) + (size_t)hdr.slot_cnt * sizeof(struct cache_entry)){
+      return(hdr.slot_cnt);
+   }
+
+   return(0);
+} // END OF cache_valid
+
+/* Open (or create) the cache file at path and map it. Only an empty file or an
+ * unusable cache (one that starts with the cache magic) is formatted; anything
+ * else is left alone and the run goes on without a cache. The file is only
+ * locked while it is checked here, and later around each lookup and store. */
+static void cache_open(struct count_cache *c, const char *path){
+   struct stat filestat;
+   char magic[8];
+   unsigned int slot_cnt;
+
+   c->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+   if(c->fd == -1 || flock(c->fd, LOCK_EX) == -1){
+      fprintf(stderr, "mywc: %s: %s\n", path, strerror(errno));
+      if(c->fd != -1){
+         close(c->fd);
+         c->fd = -1;
+      }
+      return;
+   }
+
+   slot_cnt = cache_valid(c->fd);
+   if(slot_cnt == 0 && fstat(c->fd, &filestat) == 0 && filestat.st_size != 0 &&
+      (pread(c->fd, magic, 8, 0) != 8 || memcmp(magic, "MYWCACHE", 8) != 0)){
+      fprintf(stderr, "mywc: %s: not a cache file, not using it\n", path);
+      close(c->fd);
+      c->fd = -1;
+      return;
+   }
+   if(cache_map(c, slot_cnt ? slot_cnt : CACHE_MIN_SLOTS, slot_cnt == 0) == 0){
+      flock(c->fd, LOCK_UN);
+      return;
+   }
+
+   fprintf(stderr, "mywc: %s: %s\n", path, strerror(errno));
+   close(c->fd);
+   c->fd = -1;
+
+   return;
+} // END OF cache_open
+
+static void cache_close(struct count_cache *c){
+   if(c->hdr != NULL){
+      munmap(c->hdr, c->map_len);
+      c->hdr = NULL;
+   }
+   if(c->fd != -1){
+      close(c->fd);
+      c->fd = -1;
+   }
+
+   return;
+} // END OF cache_close
+
+/* Lock the cache file with op (LOCK_SH or LOCK_EX). If another run has grown
+ * the table since it was mapped here, map it again at its new size. Returns 0,
+ * or -1 with the cache closed. */
+static int cache_lock(struct count_cache *c, int op){
+   unsigned int slot_cnt;
+
+   if(flock(c->fd, op) == -1){
+      fprintf(stderr, "mywc: cache: %s\n", strerror(errno));
+      cache_close(c);
+      return(-1);
+   }
+   if(c->hdr->slot_cnt == c->slot_cnt){
+      return(0);
+   }
+
+   munmap(c->hdr, c->map_len);
+   c->hdr = NULL;
+   slot_cnt = cache_valid(c->fd);
+   if(slot_cnt == 0 || cache_map(c, slot_cnt, 0) == -1){
+      fprintf(stderr, "mywc: cache: %s\n", slot_cnt ? strerror(errno) : "changed into an invalid file");
+      cache_close(c);
+      return(-1);
+   }
+
+   return(0);
+} // END OF cache_lock
+
+/* Index of the slot where (dev, ino) starts probing */
+static unsigned long long cache_home(const struct count_cache *c, unsigned long long dev, unsigned long long ino){
+   unsigned long long h = (dev * 0x9E3779B97F4A7C15ULL) ^ ino;
+
+   // splitmix64 finalizer, so consecutive inode numbers spread over the table
+   h ^= h >> 30;
+   h *= 0xBF58476D1CE4E5B9ULL;
+   h ^= h >> 27;
+   h *= 0x94D049BB133111EBULL;
+   h ^= h >> 31;
+
+   return(h & (c->hdr->slot_cnt - 1));
+} // END OF cache_home
+
+/* Return the slot holding (dev, ino), or the empty slot where it belongs */
+static struct cache_entry * cache_slot(struct count_cache *c, unsigned long long dev, unsigned long long ino){
+   unsigned long long mask = c->hdr->slot_cnt - 1;
+   unsigned long long h;
+
+   for(h = cache_home(c, dev, ino); ; h = (h + 1) & mask){
+      struct cache_entry *e = &c->slots[h];
+
+      if(!e->used || (e->dev == dev && e->ino == ino)){
+         return(e);
+      }
+   }
+} // END OF cache_slot
+
+/* Double the number of slots and rehash every entry. Keeps the table under 3/4 full
+ * so probe sequences stay short and cache_slot always finds an empty slot. */
+static int cache_grow(struct count_cache *c){
+   unsigned int old_cnt = c->hdr->slot_cnt;
+   struct cache_entry *old = malloc((size_t)old_cnt * sizeof(struct cache_entry));
+   unsigned int i;
+
+   if(old == NULL){
+      return(-1);
+   }
+   memcpy(old, c->slots, (size_t)old_cnt * sizeof(struct cache_entry));
+   munmap(c->hdr, c->map_len);
+
+   if(cache_map(c, old_cnt * 2, 1) == -1){
+      free(old);
+      cache_close(c);
+      return(-1);
+   }
+   for(i=0; i<old_cnt; i++){
+      if(old[i].used){
+         *cache_slot(c, old[i].dev, old[i].ino) = old[i];
+         c->hdr->used_cnt++;
+      }
+   }
+   free(old);
+
+   return(0);
+} // END OF cache_grow
+
+/* Look up the file described by filestat. Returns 1 and fills counts on a hit. */
+static int cache_lookup(const struct stat *filestat, struct wc_counts *counts){
+   long long mtime_ns = filestat->st_mtim.tv_sec * 1000000000LL + filestat->st_mtim.tv_nsec;
+   struct cache_entry *e;
+   int hit;
+
+   if(cache_lock(&cache, LOCK_SH) == -1){
+      cache.misses++;
+      return(0);
+   }
+   e = cache_slot(&cache, filestat->st_dev, filestat->st_ino);
+   hit = (e->used && e->size == filestat->st_size && e->mtime_ns == mtime_ns && (e->flags & count_flags) == count_flags);
+   if(hit){
+      *counts = e->counts;
+   }
+   flock(cache.fd, LOCK_UN);
+   if(hit){
+      cache.hits++;
+      return(1);
+   }
+   cache.misses++;
+
+   return(0);
+} // END OF cache_lookup
+
+/* Remember counts for the file described by filestat, which must have been taken
+ * before the file was read so a later change always shows up as a newer mtime */
+static void cache_store(const struct stat *filestat, const struct wc_counts *counts){
+   struct cache_entry *e;
+
+   if(cache_lock(&cache, LOCK_EX) == -1){
+      return;
+   }
+   e = cache_slot(&cache, filestat->st_dev, filestat->st_ino);
+   if(!e->used && (cache.hdr->used_cnt + 1) * 4 > (unsigned long long)cache.hdr->slot_cnt * 3){
+      // At the size limit, evict whatever sits in the new file's first probe slot.
+      // Every other entry's probe sequence still runs through an occupied slot.
+      if(cache.hdr->slot_cnt >= CACHE_MAX_SLOTS){
+         e = &cache.slots[cache_home(&cache, filestat->st_dev, filestat->st_ino)];
+      }
+      else if(cache_grow(&cache) == -1){
+         fprintf(stderr, "mywc: cache: %s\n", strerror(errno));
+         return;
+      }
       else{
-         prevchar = 1;
+         e = cache_slot(&cache, filestat->st_dev, filestat->st_ino);
       }
    }
-   stats_arr[0] = line_cnt;
-   stats_arr[1] = word_cnt;
-   stats_arr[2] = byte_cnt;
+   if(!e->used){
+      cache.hdr->used_cnt++;
+   }
+   e->dev = filestat->st_dev;
+   e->ino = filestat->st_ino;
+   e->size = filestat->st_size;
+   e->mtime_ns = filestat->st_mtim.tv_sec * 1000000000LL + filestat->st_mtim.tv_nsec;
+   e->flags = count_flags;
+   e->counts = *counts;
+   e->used = 1;
+   flock(cache.fd, LOCK_UN);
 
    return;
+} // END OF cache_store
+
+/* Calculate the number of lines, bytes, and words in the file or stdin. With --cache,
+ * regular files whose (dev, ino, size, mtime) match a cache entry are not read at all. */
+struct wc_counts calculate_file_counts(int fd){
+   struct wc_state st;
+   struct wc_counts counts;
+   struct stat filestat;
+   int cacheable = 0;
+
+   // Cached counts cover the whole file, so they only apply from offset 0
+   if(cache.hdr != NULL && lseek(fd, 0, SEEK_CUR) == 0 && fstat(fd, &filestat) == 0 && S_ISREG(filestat.st_mode)){
+      if(cache_lookup(&filestat, &counts)){
+         lseek(fd, 0, SEEK_END);
+         return(counts);
+      }
+      cacheable = 1;
+   }
+
+   wc_init(&st, count_flags);
+   count_fd(fd, &st);
+   counts = wc_finish(&st);
+
+   if(cacheable && cache.hdr != NULL){
+      cache_store(&filestat, &counts);
+   }
+
+   return(counts);
 } //END OF calculate_file_counts
 
+/* Print the columns selected in show followed by name */
+static void print_counts(const struct wc_counts *counts, unsigned int show, const char *name){
+   if(show & SHOW_LINES){
+      printf("%lld ", counts->lines);
+   }
+   if(show & SHOW_WORDS){
+      printf("%lld ", counts->words);
+   }
+   if(show & SHOW_CHARS){
+      printf("%lld ", counts->chars);
+   }
+   if(show & SHOW_BYTES){
+      printf("%lld ", counts->bytes);
+   }
+   if(show & SHOW_MAX_LINE){
+      printf("%lld ", counts->max_line);
+   }
+   printf("%s\n", name);
+
+   return;
+} // END OF print_counts
+
+/* A file watched by -f. st holds the counts and word/line state up to offset. */
+struct follow_file {
+   char *name;
+   int fd;
+   int wd;        // inotify watch descriptor, or -1 once the file is gone
+   int changed;   // set when an event arrives, cleared once the new bytes are counted
+   off_t offset;
+   struct wc_state st;
+};
+
+/* Count the bytes appended to ff since the last call. A file that shrank was
+ * truncated or rewritten, so it is counted again from the start. */
+static void follow_update(struct follow_file *ff, unsigned char *buf){
+   struct stat filestat;
+   ssize_t nread;
+
+   if(fstat(ff->fd, &filestat) == 0 && filestat.st_size < ff->offset){
+      wc_init(&ff->st, count_flags);
+      ff->offset = 0;
+   }
+
+   while( (nread = pread(ff->fd, buf, READ_BUFSIZE, ff->offset)) != 0){
+      if(nread == -1){
+         if(errno == EINTR){
+            continue;
+         }
+         fprintf(stderr, "mywc: %s: %s\n", ff->name, strerror(errno));
+         break;
+      }
+      wc_feed(&ff->st, buf, nread);
+      ff->offset += nread;
+   }
+
+   return;
+} // END OF follow_update
+
+/* Print the counts of every followed file, plus a total when there is more than one */
+static void follow_print(struct follow_file *files, int file_cnt, unsigned int show, int only_changed){
+   struct wc_counts total = {0, 0, 0, 0, 0};
+   int printed = 0;
+   int i;
+
+   for(i=0; i<file_cnt; i++){
+      struct wc_counts counts;
+
+      if(files[i].fd == -1){
+         continue;
+      }
+      counts = wc_finish(&files[i].st);
+      if(!only_changed || files[i].changed){
+         print_counts(&counts, show, files[i].name);
+         printed++;
+      }
+      total.lines += counts.lines;
+      total.words += counts.words;
+      total.chars += counts.chars;
+      total.bytes += counts.bytes;
+      if(counts.max_line > total.max_line){
+         total.max_line = counts.max_line;
+      }
+   }
+   if(file_cnt > 1 && printed > 0){
+      print_counts(&total, show, "total");
+   }
+   fflush(stdout);
+
+   return;
+} // END OF follow_print
+
+/* -f: count each file once, then wait on inotify and count only appended bytes.
+ * Runs until every file has been deleted or moved away. */
+static int follow_files(char **filenames, int file_cnt, unsigned int show){
+   struct follow_file *files = calloc(file_cnt, sizeof(struct follow_file));
+   char events[64 * (sizeof(struct inotify_event) + 256)] __attribute__((aligned(__alignof__(struct inotify_event))));
+   unsigned char *buf = malloc(READ_BUFSIZE);
+   struct stat filestat;
+   int watching = 0;
+   int i;
+
+   int ifd = inotify_init1(IN_CLOEXEC);
+   if(files == NULL || buf == NULL || ifd == -1){
+      fprintf(stderr, "mywc: %s\n", strerror(errno));
+      return(1);
+   }
+
+   for(i=0; i<file_cnt; i++){
+      files[i].name = filenames[i];
+      files[i].wd = -1;
+      files[i].fd = open(filenames[i], O_RDONLY);
+
+      if(files[i].fd == -1){
+         fprintf(stderr, "mywc: %s: %s\n", filenames[i], strerror(errno));
+         continue;
+      }
+      wc_init(&files[i].st, count_flags);
+      count_fd(files[i].fd, &files[i].st);
+      files[i].offset = files[i].st.counts.bytes;
+
+      files[i].wd = inotify_add_watch(ifd, filenames[i], IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+      if(files[i].wd == -1){
+         fprintf(stderr, "mywc: %s: %s\n", filenames[i], strerror(errno));
+      }
+      else{
+         watching++;
+      }
+   }
+   follow_print(files, file_cnt, show, 0);
+
+   while(watching > 0){
+      ssize_t len = read(ifd, events, sizeof(events));
+      char *p;
+
+      if(len == -1){
+         if(errno == EINTR){
+            continue;
+         }
+         fprintf(stderr, "mywc: inotify: %s\n", strerror(errno));
+         break;
+      }
+
+      // Several writes can arrive in one read; count each file once per batch
+      for(p = events; p < events + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len){
+         struct inotify_event *ev = (struct inotify_event *)p;
+
+         for(i=0; i<file_cnt; i++){
+            // Events were dropped, so check every file that is still watched
+            if((ev->mask & IN_Q_OVERFLOW) && files[i].wd != -1){
+               files[i].changed = 1;
+            }
+            if(files[i].wd != ev->wd || files[i].wd == -1){
+               continue;
+            }
+            if(ev->mask & IN_MODIFY){
+               files[i].changed = 1;
+            }
+            // Our open fd keeps an unlinked file alive, so IN_DELETE_SELF would never come
+            if((ev->mask & IN_ATTRIB) && fstat(files[i].fd, &filestat) == 0 && filestat.st_nlink == 0){
+               ev->mask |= IN_DELETE_SELF;
+            }
+            if(ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)){
+               inotify_rm_watch(ifd, files[i].wd);
+               files[i].wd = -1;
+               watching--;
+            }
+         }
+      }
+
+      for(i=0; i<file_cnt; i++){
+         if(files[i].changed){
+            follow_update(&files[i], buf);
+         }
+      }
+      follow_print(files, file_cnt, show, 1);
+      for(i=0; i<file_cnt; i++){
+         files[i].changed = 0;
+      }
+   }
+
+   for(i=0; i<file_cnt; i++){
+      if(files[i].fd != -1){
+         close(files[i].fd);
+      }
+   }
+   close(ifd);
+   free(files);
+   free(buf);
+
+   return(0);
+} // END OF follow_files
+
+/* Result of one file counted by --batch, reported later in argument order */
+struct batch_result {
+   struct wc_counts counts;
+   int open_error; // errno from opening the file, or 0
+   int read_error; // errno from reading the file, or 0
+   int done;       // 1 once counts is final (counted or answered from the cache)
+   struct stat filestat; // fstat() of the descriptor that was read, if cacheable
+};
+
+struct batch_result *batch_results = NULL; // One per file name once --batch has run
+
+/* A raw io_uring: the submission and completion rings shared with the kernel */
+struct uring {
+   int fd;
+   unsigned int *sq_head;
+   unsigned int *sq_tail;
+   unsigned int *sq_mask;
+   unsigned int *sq_array;
+   unsigned int sq_entries;
+   unsigned int *cq_head;
+   unsigned int *cq_tail;
+   unsigned int *cq_mask;
+   struct io_uring_sqe *sqes;
+   struct io_uring_cqe *cqes;
+   void *sq_ptr;
+   void *cq_ptr;
+   size_t sq_len;
+   size_t cq_len;
+   unsigned int to_submit;
+};
+
+/* One file being read by the io_uring batch */
+struct uring_slot {
+   int file;   // index into the file names, or -1 when the slot is free
+   int fd;
+   off_t offset;
+   unsigned char *buf;
+   struct wc_state st;
+};
+
+enum uring_op { URING_OPEN, URING_READ, URING_CLOSE };
+
+/* Set up an io_uring with the given number of entries and check that it supports
+ * the openat/read/close operations the batch needs. Returns -1 if it cannot be used. */
+static int uring_init(struct uring *r, unsigned int entries){
+   struct io_uring_params params;
+   struct io_uring_probe *probe;
+   int usable;
+
+   memset(&params, 0, sizeof(params));
+   r->fd = syscall(__NR_io_uring_setup, entries, &params);
+   if(r->fd == -1){
+      return(-1);
+   }
+
+   probe = calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+   usable = probe != NULL && syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+            probe->last_op >= IORING_OP_CLOSE &&
+            (probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) &&
+            (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+            (probe->ops[IORING_OP_CLOSE].flags & IO_URING_OP_SUPPORTED);
+   free(probe);
+   if(!usable){
+      close(r->fd);
+      return(-1);
+   }
+
+   r->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+   r->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+   if(params.features & IORING_FEAT_SINGLE_MMAP){
+      r->sq_len = r->cq_len = (r->sq_len > r->cq_len) ? r->sq_len : r->cq_len;
+   }
+
+   r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+   if(r->sq_ptr == MAP_FAILED){
+      close(r->fd);
+      return(-1);
+   }
+   r->cq_ptr = r->sq_ptr;
+   if(!(params.features & IORING_FEAT_SINGLE_MMAP)){
+      r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+      if(r->cq_ptr == MAP_FAILED){
+         munmap(r->sq_ptr, r->sq_len);
+         close(r->fd);
+         return(-1);
+      }
+   }
+   r->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+   if(r->sqes == MAP_FAILED){
+      if(r->cq_ptr != r->sq_ptr){
+         munmap(r->cq_ptr, r->cq_len);
+      }
+      munmap(r->sq_ptr, r->sq_len);
+      close(r->fd);
+      return(-1);
+   }
+
+   r->sq_head    = (unsigned int *)((char *)r->sq_ptr + params.sq_off.head);
+   r->sq_tail    = (unsigned int *)((char *)r->sq_ptr + params.sq_off.tail);
+   r->sq_mask    = (unsigned int *)((char *)r->sq_ptr + params.sq_off.ring_mask);
+   r->sq_array   = (unsigned int *)((char *)r->sq_ptr + params.sq_off.array);
+   r->sq_entries = params.sq_entries;
+   r->cq_head    = (unsigned int *)((char *)r->cq_ptr + params.cq_off.head);
+   r->cq_tail    = (unsigned int *)((char *)r->cq_ptr + params.cq_off.tail);
+   r->cq_mask    = (unsigned int *)((char *)r->cq_ptr + params.cq_off.ring_mask);
+   r->cqes       = (struct io_uring_cqe *)((char *)r->cq_ptr + params.cq_off.cqes);
+   r->to_submit  = 0;
+
+   return(0);
+} // END OF uring_init
+
+static void uring_exit(struct uring *r){
+   munmap(r->sqes, r->sq_entries * sizeof(struct io_uring_sqe));
+   if(r->cq_ptr != r->sq_ptr){
+      munmap(r->cq_ptr, r->cq_len);
+   }
+   munmap(r->sq_ptr, r->sq_len);
+   close(r->fd);
+
+   return;
+} // END OF uring_exit
+
+/* Queue one operation for slot. The caller never has more operations in flight than
+ * there are submission entries, so a free entry always exists. */
+static void uring_queue(struct uring *r, enum uring_op op, int slot, struct uring_slot *s, const char *name){
+   unsigned int tail = *r->sq_tail;
+   unsigned int index = tail & *r->sq_mask;
+   struct io_uring_sqe *sqe = &r->sqes[index];
+
+   memset(sqe, 0, sizeof(*sqe));
+   if(op == URING_OPEN){
+      sqe->opcode = IORING_OP_OPENAT;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (unsigned long)name;
+      sqe->open_flags = O_RDONLY | O_CLOEXEC;
+   }
+   else if(op == URING_READ){
+      sqe->opcode = IORING_OP_READ;
+      sqe->fd = s->fd;
+      sqe->addr = (unsigned long)s->buf;
+      sqe->len = BATCH_BUFSIZE;
+      sqe->off = s->offset;
+   }
+   else{
+      sqe->opcode = IORING_OP_CLOSE;
+      sqe->fd = s->fd;
+   }
+   sqe->user_data = ((unsigned long long)op << 32) | (unsigned int)slot;
+
+   r->sq_array[index] = index;
+   __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+   r->to_submit++;
+
+   return;
+} // END OF uring_queue
+
+/* Count the files in todo with up to BATCH_DEPTH opens/reads in flight on an io_uring.
+ * Each completion is counted as it arrives. Returns -1 if io_uring is unavailable. */
+static int batch_uring(char **filenames, int *todo, int todo_cnt, struct batch_result *results){
+   struct uring r;
+   struct uring_slot slots[BATCH_DEPTH];
+   int next = 0;     // next entry of todo to open
+   int inflight = 0; // slots in use
+   int submitted;
+   int i;
+
+   if(uring_init(&r, BATCH_DEPTH) == -1){
+      return(-1);
+   }
+   for(i=0; i<BATCH_DEPTH; i++){
+      slots[i].file = -1;
+      slots[i].buf = malloc(BATCH_BUFSIZE);
+      if(slots[i].buf == NULL){
+         fprintf(stderr, "mywc: %s\n", strerror(errno));
+         exit(1);
+      }
+   }
+
+   while(next < todo_cnt || inflight > 0){
+      unsigned int head, tail;
+
+      // Start opening more files while there are free slots
+      for(i=0; i<BATCH_DEPTH && next < todo_cnt; i++){
+         if(slots[i].file == -1){
+            slots[i].file = todo[next++];
+            slots[i].fd = -1;
+            slots[i].offset = 0;
+            wc_init(&slots[i].st, count_flags);
+            uring_queue(&r, URING_OPEN, i, &slots[i], filenames[slots[i].file]);
+            inflight++;
+         }
+      }
+
+      submitted = syscall(__NR_io_uring_enter, r.fd, r.to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+      if(submitted == -1){
+         if(errno == EINTR){
+            continue;
+         }
+         fprintf(stderr, "mywc: io_uring_enter: %s\n", strerror(errno));
+         exit(1);
+      }
+      // Entries the kernel did not take stay in the ring for the next call
+      r.to_submit -= submitted;
+
+      head = *r.cq_head;
+      tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+      for(; head != tail; head++){
+         struct io_uring_cqe *cqe = &r.cqes[head & *r.cq_mask];
+         int slot = (int)(cqe->user_data & 0xFFFFFFFF);
+         enum uring_op op = (enum uring_op)(cqe->user_data >> 32);
+         struct uring_slot *s = &slots[slot];
+         struct batch_result *res = &results[s->file];
+
+         if(op == URING_OPEN){
+            if(cqe->res < 0){
+               res->open_error = -cqe->res;
+               res->done = 1;
+               s->file = -1;
+               inflight--;
+            }
+            else{
+               s->fd = cqe->res;
+               if(cache.hdr != NULL && fstat(s->fd, &res->filestat) == -1){
+                  res->filestat.st_mode = 0;
+               }
+               uring_queue(&r, URING_READ, slot, s, NULL);
+            }
+         }
+         else if(op == URING_READ){
+            if(cqe->res > 0){
+               wc_feed(&s->st, s->buf, cqe->res);
+               s->offset += cqe->res;
+               uring_queue(&r, URING_READ, slot, s, NULL);
+            }
+            else{
+               if(cqe->res < 0){
+                  res->read_error = -cqe->res;
+               }
+               res->counts = wc_finish(&s->st);
+               res->done = 1;
+               uring_queue(&r, URING_CLOSE, slot, s, NULL);
+            }
+         }
+         else{
+            s->file = -1;
+            inflight--;
+         }
+      }
+      __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+   }
+
+   for(i=0; i<BATCH_DEPTH; i++){
+      free(slots[i].buf);
+   }
+   uring_exit(&r);
+
+   return(0);
+} // END OF batch_uring
+
+/* Shared work list for the thread pool used when io_uring is unavailable */
+struct batch_pool {
+   char **filenames;
+   int *todo;
+   int todo_cnt;
+   int next; // next entry of todo to hand out, taken with an atomic add
+   struct batch_result *results;
+};
+
+/* Thread body: keep taking the next file from the pool until none are left */
+static void * batch_worker(void *arg){
+   struct batch_pool *pool = arg;
+   int n;
+
+   while( (n = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->todo_cnt){
+      int file = pool->todo[n];
+      struct batch_result *res = &pool->results[file];
+      struct wc_state st;
+      int fd = open(pool->filenames[file], O_RDONLY | O_CLOEXEC);
+
+      if(fd == -1){
+         res->open_error = errno;
+      }
+      else{
+         if(cache.hdr != NULL && fstat(fd, &res->filestat) == -1){
+            res->filestat.st_mode = 0;
+         }
+         wc_init(&st, count_flags);
+         count_fd(fd, &st);
+         res->counts = wc_finish(&st);
+         close(fd);
+      }
+      res->done = 1;
+   }
+
+   return(NULL);
+} // END OF batch_worker
+
+/* Count the files in todo on BATCH_THREADS threads */
+static void batch_threads(char **filenames, int *todo, int todo_cnt, struct batch_result *results){
+   struct batch_pool pool = {filenames, todo, todo_cnt, 0, results};
+   pthread_t tids[BATCH_THREADS];
+   int started = 0;
+   int i;
+
+   for(i=0; i<BATCH_THREADS && i<todo_cnt; i++){
+      if(pthread_create(&tids[started], NULL, batch_worker, &pool) == 0){
+         started++;
+      }
+   }
+   // If no thread could be started, do the work here
+   if(started == 0){
+      batch_worker(&pool);
+   }
+   for(i=0; i<started; i++){
+      pthread_join(tids[i], NULL);
+   }
+
+   return;
+} // END OF batch_threads
+
+/* --batch: count every file up front, with many opens and reads in flight at once.
+ * Files answered by the cache are skipped, and new counts are stored back into it
+ * under the identity fstat() gave for the descriptor that was actually read. */
+static void run_batch(char **filenames, int file_cnt){
+   struct stat filestat;
+   int *todo = malloc(file_cnt * sizeof(int));
+   int todo_cnt = 0;
+   int i;
+
+   batch_results = calloc(file_cnt, sizeof(struct batch_result));
+   if(todo == NULL || batch_results == NULL){
+      fprintf(stderr, "mywc: %s\n", strerror(errno));
+      exit(1);
+   }
+
+   for(i=0; i<file_cnt; i++){
+      if(cache.hdr != NULL && stat(filenames[i], &filestat) == 0 && S_ISREG(filestat.st_mode) &&
+         cache_lookup(&filestat, &batch_results[i].counts)){
+         batch_results[i].done = 1;
+         continue;
+      }
+      todo[todo_cnt++] = i;
+   }
+
+   if(todo_cnt > 0 && batch_uring(filenames, todo, todo_cnt, batch_results) == -1){
+      batch_threads(filenames, todo, todo_cnt, batch_results);
+   }
+
+   for(i=0; i<todo_cnt; i++){
+      int file = todo[i];
+
+      if(cache.hdr != NULL && S_ISREG(batch_results[file].filestat.st_mode) &&
+         batch_results[file].open_error == 0 && batch_results[file].read_error == 0){
+         cache_store(&batch_results[file].filestat, &batch_results[file].counts);
+      }
+   }
+   free(todo);
+
+   return;
+} // END OF run_batch
+
+/* Append the NUL-separated file names in path ("-" for stdin) to the name list */
+static int read_files0(const char *path, char ***filenames, int *file_cnt){
+   int fd = (strcmp(path, "-") == 0) ? STDIN_FILENO : open(path, O_RDONLY);
+   size_t len = 0, cap = 1 << 16;
+   char *list = malloc(cap);
+   char *name;
+   ssize_t nread;
+
+   if(fd == -1 || list == NULL){
+      fprintf(stderr, "mywc: cannot open '%s' for reading: %s\n", path, strerror(errno));
+      free(list);
+      return(-1);
+   }
+   while( (nread = read(fd, list + len, cap - len - 1)) != 0){
+      if(nread == -1){
+         if(errno == EINTR){
+            continue;
+         }
+         fprintf(stderr, "mywc: %s: %s\n", path, strerror(errno));
+         break;
+      }
+      len += nread;
+      if(cap - len - 1 == 0){
+         char *bigger = realloc(list, cap * 2);
+         if(bigger == NULL){
+            fprintf(stderr, "mywc: %s\n", strerror(errno));
+            exit(1);
+         }
+         list = bigger;
+         cap *= 2;
+      }
+   }
+   if(fd != STDIN_FILENO){
+      close(fd);
+   }
+   list[len] = '\0';
+
+   for(name = list; name < list + len; name += strlen(name) + 1){
+      char **grown;
+
+      if(*name == '\0'){
+         fprintf(stderr, "mywc: %s: invalid zero-length file name\n", path);
+         continue;
+      }
+      grown = realloc(*filenames, (*file_cnt + 1) * sizeof(char *));
+      if(grown == NULL){
+         fprintf(stderr, "mywc: %s\n", strerror(errno));
+         exit(1);
+      }
+      *filenames = grown;
+      (*filenames)[*file_cnt] = strdup(name);
+      (*file_cnt)++;
+   }
+   free(list);
+
+   return(0);
+} // END OF read_files0
+
+/* Get the counts of file i, from the --batch results if the batch ran or by counting
+ * it now. Returns -1 (after printing the error) if the file could not be opened. */
+static int file_counts(char *filename, int i, struct wc_counts *counts){
+   if(batch_results != NULL){
+      if(batch_results[i].open_error){
+         fprintf(stderr, "mywc: %s: %s\n", filename, strerror(batch_results[i].open_error));
+         return(-1);
+      }
+      if(batch_results[i].read_error){
+         fprintf(stderr, "mywc: read: %s\n", strerror(batch_results[i].read_error));
+      }
+      *counts = batch_results[i].counts;
+      return(0);
+   }
+   else{
+      int fd = open(filename, O_RDONLY);
+
+      if(fd == -1){
+         fprintf(stderr, "mywc: %s: %s\n", filename, strerror(errno));
+         return(-1);
+      }
+      *counts = calculate_file_counts(fd);
+      close(fd);
+      return(0);
+   }
+} // END OF file_counts
+
 int main(int argc, char *argv[]){
    int line_cnt_flag = 0;
    int word_cnt_flag = 0;
    int byte_cnt_flag = 0;
+   int char_cnt_flag = 0;
+   int max_line_flag = 0;
+   int follow_flag   = 0;
+   int cache_stats_flag = 0;
+   char *cache_path = NULL;
+   int batch_flag = 0;
+   char *files0_path = NULL;
 
    int arg_cnt  = 0;
    int file_cnt = 0;
@@ -65,8 +1211,53 @@ int main(int argc, char *argv[]){
    while(--argc){
       char *argstr = argv[++arg_cnt]; // Point to the current string to process      
 
+      // Check if argstr is a long option
+      if(strncmp(argstr, "--", 2) == 0){
+         if(strcmp(argstr, "--io=mmap") == 0){
+            io_mode = IO_MMAP;
+         }
+         else if(strcmp(argstr, "--io=read") == 0){
+            io_mode = IO_READ;
+         }
+         else if(strcmp(argstr, "--io=stdio") == 0){
+            io_mode = IO_STDIO;
+         }
+         else if(strcmp(argstr, "--cache") == 0 || strncmp(argstr, "--cache=", 8) == 0){
+            cache_path = (argstr[7] == '=') ? argstr + 8 : "";
+         }
+         else if(strcmp(argstr, "--cache-stats") == 0){
+            cache_stats_flag = 1;
+         }
+         else if(strcmp(argstr, "--batch") == 0){
+            batch_flag = 1;
+         }
+         else if(strncmp(argstr, "--files0-from=", 14) == 0){
+            files0_path = argstr + 14;
+            batch_flag = 1;
+         }
+         else if(strcmp(argstr, "--threads") == 0 || strncmp(argstr, "--threads=", 10) == 0){
+            char *value = argstr + 9;
+
+            if(*value == '='){
+               value++;
+            }
+            else if(argc > 1){
+               argc--;
+               value = argv[++arg_cnt];
+            }
+            thread_cnt = atoi(value);
+            if(thread_cnt < 1 || thread_cnt > MAX_THREADS){
+               printf("mywc: invalid number of threads: '%s'\n", value);
+               return(0);
+            }
+         }
+         else{
+            printf("mywc: unrecognized option '%s'\n", argstr);
+            return(0);
+         }
+      }
       // Check if argstr is options
-      if(*argstr == '-'){
+      else if(*argstr == '-'){
          while(*(++argstr)){
             switch (*argstr) {
                case 'c': 
@@ -78,6 +1269,17 @@ int main(int argc, char *argv[]){
                case 'w': 
                   word_cnt_flag = 1;
                   break;
+               case 'm': 
+                  char_cnt_flag = 1;
+                  count_flags |= WC_CHARS;
+                  break;
+               case 'L': 
+                  max_line_flag = 1;
+                  count_flags |= WC_MAX_LINE;
+                  break;
+               case 'f': 
+                  follow_flag = 1;
+                  break;
                default:
                   printf("mywc: invalid option -- '%c'\n", *argstr);
                   return(0); 
@@ -86,59 +1288,106 @@ int main(int argc, char *argv[]){
       }
       // Else argstr is a filename so record it so it can be processed later 
       else {
-         filenames[file_cnt] = malloc(strlen(argstr) * sizeof(char)); 
+         filenames[file_cnt] = malloc((strlen(argstr) + 1) * sizeof(char)); 
          strcpy(filenames[file_cnt], argstr);
          file_cnt++;
       }
    }
    
-   // If at least one option flag was specified
-   if( line_cnt_flag | word_cnt_flag | byte_cnt_flag ){
+   // Open the count cache, defaulting to ~/.mywc_cache
+   if(cache_path != NULL || cache_stats_flag){
+      char default_path[4096];
+
+      if(cache_path == NULL || *cache_path == '\0'){
+         snprintf(default_path, sizeof(default_path), "%s/.mywc_cache", getenv("HOME") ? getenv("HOME") : ".");
+         cache_path = default_path;
+      }
+      cache_open(&cache, cache_path);
+   }
+
+   // Add the names from --files0-from after the ones on the command line
+   if(files0_path != NULL && read_files0(files0_path, &filenames, &file_cnt) == -1){
+      return(1);
+   }
+
+   // Count everything up front; the loops below then only print the results
+   if(batch_flag && !follow_flag && file_cnt > 0){
+      run_batch(filenames, file_cnt);
+   }
+
+   // Follow the files as they grow
+   if(follow_flag){
+      unsigned int show = (line_cnt_flag ? SHOW_LINES : 0) | (word_cnt_flag ? SHOW_WORDS : 0) |
+                          (char_cnt_flag ? SHOW_CHARS : 0) | (byte_cnt_flag ? SHOW_BYTES : 0) |
+                          (max_line_flag ? SHOW_MAX_LINE : 0);
+
+      if(show == 0){
+         show = SHOW_LINES | SHOW_WORDS | SHOW_BYTES;
+      }
+      if(file_cnt == 0){
+         fprintf(stderr, "mywc: -f needs at least one file name\n");
+      }
+      else{
+         follow_files(filenames, file_cnt, show);
+      }
+   }
+   // Else if at least one option flag was specified
+   else if( line_cnt_flag | word_cnt_flag | char_cnt_flag | byte_cnt_flag | max_line_flag ){
       // If at least one file name was specified
       // Output the values corresponding to the flags followed by the file name
       if(file_cnt){
-         int line_total = 0;
-         int word_total = 0;
-         int byte_total = 0;
+         long long line_total = 0;
+         long long word_total = 0;
+         long long byte_total = 0;
+         long long char_total = 0;
+         long long max_line_total = 0;
 
          int i;
          for(i=0; i<file_cnt; i++){
-            FILE *fp;
-            fp = fopen(filenames[i], "r");
+            struct wc_counts counts;
 
-            if(fp == NULL){
-               fprintf(stderr, "mywc: %s: %s\n", filenames[i], strerror(errno)); 
-            }
-            else{
-               calculate_file_counts(fp);
-    
+            if(file_counts(filenames[i], i, &counts) == 0){
                if(line_cnt_flag){
-                  line_total += stats_arr[0];
-                  printf("%d ", stats_arr[0]);
+                  line_total += counts.lines;
+                  printf("%lld ", counts.lines);
                }
                if(word_cnt_flag){
-                  word_total += stats_arr[1];
-                  printf("%d ", stats_arr[1]);
+                  word_total += counts.words;
+                  printf("%lld ", counts.words);
+               }
+               if(char_cnt_flag){
+                  char_total += counts.chars;
+                  printf("%lld ", counts.chars);
                }
                if(byte_cnt_flag){
-                  byte_total += stats_arr[2];
-                  printf("%d ", stats_arr[2]);
+                  byte_total += counts.bytes;
+                  printf("%lld ", counts.bytes);
+               }
+               if(max_line_flag){
+                  if(counts.max_line > max_line_total){
+                     max_line_total = counts.max_line;
+                  }
+                  printf("%lld ", counts.max_line);
                }
                printf("%s\n", filenames[i]); 
-
-               fclose(fp);
             }
          }
          // Output line, word, and byte count totals if more than one file was specified
          if(file_cnt > 1){
             if(line_cnt_flag){
-               printf("%d ", line_total);
+               printf("%lld ", line_total);
             }
             if(word_cnt_flag){
-               printf("%d ", word_total);
+               printf("%lld ", word_total);
+            }
+            if(char_cnt_flag){
+               printf("%lld ", char_total);
             }
             if(byte_cnt_flag){
-               printf("%d ", byte_total);
+               printf("%lld ", byte_total);
+            }
+            if(max_line_flag){
+               printf("%lld ", max_line_total);
             }
             printf("total\n"); 
          }
@@ -146,16 +1395,22 @@ int main(int argc, char *argv[]){
       // Else no file name so read from STDIN
       // Output the values corresponding to the flags 
       else{
-         calculate_file_counts(stdin);
+         struct wc_counts counts = calculate_file_counts(STDIN_FILENO);
     
          if(line_cnt_flag){
-            printf("%d ", stats_arr[0]);
+            printf("%lld ", counts.lines);
          }
          if(word_cnt_flag){
-            printf("%d ", stats_arr[1]);
+            printf("%lld ", counts.words);
+         }
+         if(char_cnt_flag){
+            printf("%lld ", counts.chars);
          }
          if(byte_cnt_flag){
-            printf("%d ", stats_arr[2]);
+            printf("%lld ", counts.bytes);
+         }
+         if(max_line_flag){
+            printf("%lld ", counts.max_line);
          }
          printf("\n");
       }
@@ -165,52 +1420,49 @@ int main(int argc, char *argv[]){
       // If at least one file name was specified
       // Output line, word, and byte counts followed by the file name
       if(file_cnt){
-         int line_total = 0;
-         int word_total = 0;
-         int byte_total = 0;
+         long long line_total = 0;
+         long long word_total = 0;
+         long long byte_total = 0;
 
          int i;
          for(i=0; i<file_cnt; i++){
-            FILE *fp;
-            fp = fopen(filenames[i], "r");
+            struct wc_counts counts;
 
-            if(fp == NULL){
-               fprintf(stderr, "mywc: %s: %s\n", filenames[i], strerror(errno)); 
-            }
-            else{
-               calculate_file_counts(fp);
-    
-               line_total += stats_arr[0];
-               word_total += stats_arr[1];
-               byte_total += stats_arr[2];
+            if(file_counts(filenames[i], i, &counts) == 0){
+               line_total += counts.lines;
+               word_total += counts.words;
+               byte_total += counts.bytes;
 
-               printf("%d ", stats_arr[0]);
-               printf("%d ", stats_arr[1]);
-               printf("%d ", stats_arr[2]);
+               printf("%lld ", counts.lines);
+               printf("%lld ", counts.words);
+               printf("%lld ", counts.bytes);
                printf("%s\n", filenames[i]); 
-
-               fclose(fp);
             }
          }
          // Output line, word, and byte count totals if more than one file was specified
          if(file_cnt > 1){
-            printf("%d ", line_total);
-            printf("%d ", word_total);
-            printf("%d ", byte_total);
+            printf("%lld ", line_total);
+            printf("%lld ", word_total);
+            printf("%lld ", byte_total);
             printf("total\n"); 
          }
       }
       // Else no file name so read from STDIN
       // Output line, word, and byte counts
       else{
-         calculate_file_counts(stdin);
+         struct wc_counts counts = calculate_file_counts(STDIN_FILENO);
     
-         printf("\t%d", stats_arr[0]);
-         printf("\t%d", stats_arr[1]);
-         printf("\t%d\n", stats_arr[2]);
+         printf("\t%lld", counts.lines);
+         printf("\t%lld", counts.words);
+         printf("\t%lld\n", counts.bytes);
       }
    }
 
+   if(cache_stats_flag){
+      fprintf(stderr, "mywc: cache: %lld hits, %lld misses\n", cache.hits, cache.misses);
+   }
+   cache_close(&cache);
+
    // Free pointers
    int i;
    for(i=0; i<file_cnt; i++){
@@ -1,17 +1,38 @@
 /*********************************************************
 * PROGRAM NAME: mywc_pf_pf.c (mywc_pf using pipes and forks)
 *
-* INPUT: 
-*     (OPTIONAL) STRING: The name of the file(s) to perform wordcount on. 
+* INPUT:
+*     (OPTIONAL) STRING: The name of the file(s) to perform wordcount on.
+*     (OPTIONAL) --workers N: Number of worker processes (default: online CPUs).
+*     (OPTIONAL) --split-size=BYTES: Regular files at least this big (default 64M) are
+*                split into byte ranges counted by different workers. Files bigger
+*                than their fair share (total bytes / workers) are split as well.
+*                K/M/G suffixes are accepted; 0 turns splitting off.
+*     (OPTIONAL) --ranges=N: Number of ranges per split file (default: enough ranges to
+*                cut the file into fair-share pieces, at most --workers).
+*     (OPTIONAL) --stats: Report per-task and per-worker timing on stderr: wall and
+*                CPU time, bytes read, MB/s, major page faults, worker utilization,
+*                and load imbalance.
 *
-* OUTPUT: The same as Unix's wc command for the c, l, and w options for 0+ files. 
+* OUTPUT: The same as Unix's wc command for the c, l, and w options for 0+ files.
 *         The process ID for each process that processed a command line file (or the
 *         one process that processed all files in the current directory) is appended
 *         to the wc output.
 *
-* DESCRIPTION: Simulate Unix's wc command with the c, l, and w options for 0+ files. 
-*              It creates as many processes as their are files on the command line.
-*              If no file names are entered, then 1 process is created.
+* DESCRIPTION: Simulate Unix's wc command with the c, l, and w options for 0+ files.
+*              A fixed pool of worker processes is forked up front. Each worker takes
+*              the next task from a queue in shared memory, counts it, and stores the
+*              result straight into that task's slot of a shared result table, then
+*              wakes the parent through an eventfd. A task is a whole file, or one
+*              byte range of a big file that the parent opened before forking so
+*              workers can pread it through the inherited descriptor.
+*              Every input is stat()ed first and tasks are handed out largest first
+*              (longest-processing-time scheduling), so a big file is never left
+*              to start last. The parent merges the ranges of each file and prints
+*              the files in argument order.
+*              If no file names are entered, then 1 process counts stdin.
+*              Counting is done by the wc_count library:
+*                 gcc -O2 mywc_pf.c wc_count.c -o mywc_pf
 *
 *********************************************************/
 #include <errno.h>
@@ -19,52 +40,392 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include "wc_count.h"
+
+#define READ_BUFSIZE (1 << 20) // Bytes requested from read() per call
+#define REAP_INTERVAL_MS 200 // How often the parent checks for dead workers while waiting
+#define MAX_WORKERS 1024
+#define DEFAULT_SPLIT_SIZE (64LL << 20) // Smallest file split into ranges by default
+#define MIN_SHARE_SPLIT (1LL << 20) // Files under this are never split for balance alone
+
+
+/* One unit of work: a whole file, or one byte range of a file */
+struct task {
+   int file;    // index of the file in the argument list
+   int fd;      // descriptor opened by the parent for a range, or -1 to open the file
+   off_t start; // first byte of the range
+   off_t len;   // bytes in the range, or -1 to read the whole file
+   off_t size;  // expected bytes to count, used to order the queue (0 if unknown)
+};
+
+/* Queue of task indices shared by every worker through a MAP_SHARED mapping.
+ * Workers take order[next], so tasks start in the order the parent sorted them. */
+struct task_queue {
+   int next;     // next entry of order to hand out, taken with an atomic add
+   int task_cnt;
+};
+
+/* Resource use of one task, measured by the worker when --stats is given */
+struct task_stats {
+   long long start_ns; // CLOCK_MONOTONIC when the worker took the task
+   long long wall_ns;
+   long long cpu_ns;   // user + system time from getrusage
+   long long bytes;    // bytes read and counted
+   long majflt;        // major page faults while counting
+};
+
+/* One worker's totals in a MAP_SHARED table, filled in when --stats is given */
+struct worker_slot {
+   pid_t pid;
+   int task_cnt;
+   long long first_ns; // CLOCK_MONOTONIC when the first task was taken, or 0
+   long long end_ns;   // CLOCK_MONOTONIC when the queue was found empty
+   long long busy_ns;  // wall time spent inside tasks
+   long long cpu_ns;
+   long long bytes;
+   long majflt;
+};
+
+/* One task's slot in the MAP_SHARED result table. The worker fills in everything
+ * else, then publishes the slot by storing done with release ordering. The whole
+ * counter state is kept so the parent can merge ranges with wc_merge. */
+struct result_slot {
+   int done;  // 1 once the rest of the slot is valid
+   int error; // errno from opening the file, or 0
+   pid_t pid; // worker that counted the task
+   struct wc_state st;
+   struct task_stats stats;
+};
 
-#define STATSIZE 4
+/* Calculate the number of lines, bytes, and words in the file or stdin */
+void calculate_file_counts(int fd, unsigned char *buf, struct wc_state *st){
+   ssize_t nread;
+
+   while( (nread = read(fd, buf, READ_BUFSIZE)) != 0){
+      if(nread == -1){
+         if(errno == EINTR){
+            continue;
+         }
+         fprintf(stderr, "mywc_pf: read: %s\n", strerror(errno));
+         break;
+      }
+      wc_feed(st, buf, nread);
+   }
 
+   return;
+} // END OF calculate_file_counts
 
-pid_t pid = 0; // parent waits until child process is complete
-int stats_arr[STATSIZE] = {0, 0, 0, 0}; // holds line count, word count, byte count, and process id
+/* Count len bytes of fd starting at start, without moving the shared file offset */
+void calculate_range_counts(int fd, off_t start, off_t len, unsigned char *buf, struct wc_state *st){
+   off_t offset = start;
+   ssize_t nread;
 
-/* Calculate the number of lines, bytes, and words in the file or stdin */
-void * calculate_file_counts(FILE *stream){
-   char c = '0';
-   int prevchar = 0;
-   int line_cnt = 0;
-   int word_cnt = 0;
-   int byte_cnt = 0;
-
-   while( (c=getc(stream)) != EOF){
-      byte_cnt += sizeof(c);
-
-      if(c == '\n'){
-         line_cnt++;
-
-         if(prevchar){
-            word_cnt++;
-            prevchar = 0;
+   while(offset < start + len){
+      size_t want = (start + len - offset < READ_BUFSIZE) ? (size_t)(start + len - offset) : READ_BUFSIZE;
+
+      nread = pread(fd, buf, want, offset);
+      if(nread == -1){
+         if(errno == EINTR){
+            continue;
          }
+         fprintf(stderr, "mywc_pf: read: %s\n", strerror(errno));
+         break;
+      }
+      // The file shrank underneath us
+      if(nread == 0){
+         break;
       }
-      else if(c == ' '){
-         if(prevchar){
-            word_cnt++;
-            prevchar = 0;
+      wc_feed(st, buf, nread);
+      offset += nread;
+   }
+
+   return;
+} // END OF calculate_range_counts
+
+/* Parse a byte count with an optional K, M, or G suffix. Returns -1 if invalid. */
+static long long parse_size(const char *str){
+   char *end;
+   long long size = strtoll(str, &end, 10);
+
+   if(end == str || size < 0){
+      return(-1);
+   }
+   switch(*end){
+      case 'K': case 'k':
+         size <<= 10;
+         end++;
+         break;
+      case 'M': case 'm':
+         size <<= 20;
+         end++;
+         break;
+      case 'G': case 'g':
+         size <<= 30;
+         end++;
+         break;
+   }
+
+   return(*end == '\0' ? size : -1);
+} // END OF parse_size
+
+/* Current CLOCK_MONOTONIC time in nanoseconds */
+static long long now_ns(void){
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return(ts.tv_sec * 1000000000LL + ts.tv_nsec);
+} // END OF now_ns
+
+/* User plus system time of a getrusage result in nanoseconds */
+static long long rusage_cpu_ns(const struct rusage *ru){
+   return((ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * 1000000000LL +
+          (ru->ru_utime.tv_usec + ru->ru_stime.tv_usec) * 1000LL);
+} // END OF rusage_cpu_ns
+
+/* Task list being sorted by compare_task_size */
+static const struct task *sort_tasks;
+
+/* qsort comparator for task indices: largest task first, ties in argument order */
+static int compare_task_size(const void *a, const void *b){
+   const struct task *ta = &sort_tasks[*(const int *)a];
+   const struct task *tb = &sort_tasks[*(const int *)b];
+
+   if(ta->size != tb->size){
+      return(ta->size > tb->size ? -1 : 1);
+   }
+
+   return(*(const int *)a - *(const int *)b);
+} // END OF compare_task_size
+
+/* Worker process body: count tasks from the queue until it is empty. A NULL
+ * filenames list means the single task is stdin. With a worker slot, each task
+ * is timed and the worker's totals are kept in the slot. */
+static void run_worker(struct task_queue *queue, const struct task *tasks, const int *order, char **filenames,
+                       struct result_slot *results, int event_fd, struct worker_slot *self){
+   unsigned char *buf = malloc(READ_BUFSIZE);
+   int n;
+
+   if(buf == NULL){
+      fprintf(stderr, "mywc_pf: %s\n", strerror(errno));
+      _exit(1);
+   }
+
+   while( (n = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED)) < queue->task_cnt){
+      int i = order[n];
+      const struct task *t = &tasks[i];
+      struct result_slot *rec = &results[i];
+      unsigned long long one = 1;
+      struct rusage ru_start;
+
+      rec->pid = getpid();
+      wc_init(&rec->st, 0);
+      if(self != NULL){
+         rec->stats.start_ns = now_ns();
+         getrusage(RUSAGE_SELF, &ru_start);
+         if(self->first_ns == 0){
+            self->first_ns = rec->stats.start_ns;
          }
       }
+
+      if(t->len >= 0){
+         calculate_range_counts(t->fd, t->start, t->len, buf, &rec->st);
+      }
       else{
-         prevchar = 1;
+         int fd = (filenames == NULL) ? STDIN_FILENO : open(filenames[t->file], O_RDONLY);
+
+         if(fd == -1){
+            rec->error = errno;
+         }
+         else{
+            calculate_file_counts(fd, buf, &rec->st);
+            if(fd != STDIN_FILENO){
+               close(fd);
+            }
+         }
       }
+
+      if(self != NULL){
+         struct rusage ru_end;
+
+         getrusage(RUSAGE_SELF, &ru_end);
+         rec->stats.wall_ns = now_ns() - rec->stats.start_ns;
+         rec->stats.cpu_ns = rusage_cpu_ns(&ru_end) - rusage_cpu_ns(&ru_start);
+         rec->stats.bytes = rec->st.counts.bytes;
+         rec->stats.majflt = ru_end.ru_majflt - ru_start.ru_majflt;
+         self->task_cnt++;
+         self->busy_ns += rec->stats.wall_ns;
+         self->cpu_ns += rec->stats.cpu_ns;
+         self->bytes += rec->stats.bytes;
+         self->majflt += rec->stats.majflt;
+      }
+
+      __atomic_store_n(&rec->done, 1, __ATOMIC_RELEASE);
+      if(write(event_fd, &one, sizeof(one)) == -1){
+         fprintf(stderr, "mywc_pf: %s\n", strerror(errno));
+         _exit(1);
+      }
+   }
+   free(buf);
+   if(self != NULL){
+      self->end_ns = now_ns();
    }
-   pid = getpid();
 
-   stats_arr[0] = line_cnt;
-   stats_arr[1] = word_cnt;
-   stats_arr[2] = byte_cnt;
-   stats_arr[3] = pid;
+   return;
+} // END OF run_worker
+
+/* Output the counts for one file: the flagged counts (all three when no flag was
+ * given), then the file name and the process id of the worker that started it */
+static void print_counts(const struct wc_counts *counts, pid_t pid, const char *name, int line_cnt_flag, int word_cnt_flag, int byte_cnt_flag){
+   int all = !(line_cnt_flag | word_cnt_flag | byte_cnt_flag);
+
+   // No file names and no flags: tab separated, as the original output did
+   if(name == NULL && all){
+      printf("\t%lld", counts->lines);
+      printf("\t%lld", counts->words);
+      printf("\t%lld", counts->bytes);
+      printf("\t%d", pid);
+      return;
+   }
+   if(all || line_cnt_flag){
+      printf("%lld ", counts->lines);
+   }
+   if(all || word_cnt_flag){
+      printf("%lld ", counts->words);
+   }
+   if(all || byte_cnt_flag){
+      printf("%lld ", counts->bytes);
+   }
+   if(name != NULL){
+      printf("%s ", name);
+   }
+   printf("%d\n", pid);
 
    return;
-} // END OF calculate_file_counts
+} // END OF print_counts
+
+/* Report one file in argument order from the records of its tasks, merging the
+ * ranges of a split file in file order, and add it to the totals */
+static void report_file(const struct result_slot *recs, int rec_cnt, const char *name, long long totals[3],
+                        int line_cnt_flag, int word_cnt_flag, int byte_cnt_flag){
+   struct wc_state st;
+   struct wc_counts counts;
+   int i;
+
+   wc_init(&st, 0);
+   for(i=0; i<rec_cnt; i++){
+      if(!__atomic_load_n(&recs[i].done, __ATOMIC_ACQUIRE)){
+         // The worker that took this task died before reporting it
+         fprintf(stderr, "mywc_pf: %s: no result from worker\n", name ? name : "-");
+         return;
+      }
+      if(recs[i].error){
+         fprintf(stderr, "mywc_pf: %s: %s\n", name ? name : "-", strerror(recs[i].error));
+         return;
+      }
+      wc_merge(&st, &recs[i].st);
+   }
+   counts = wc_finish(&st);
+
+   totals[0] += counts.lines;
+   totals[1] += counts.words;
+   totals[2] += counts.bytes;
+   print_counts(&counts, recs[0].pid, name, line_cnt_flag, word_cnt_flag, byte_cnt_flag);
+
+   return;
+} // END OF report_file
+
+/* Throughput in MB/s for a byte count over a duration */
+static double mb_per_sec(long long bytes, long long ns){
+   return(ns > 0 ? bytes / 1e6 / (ns / 1e9) : 0.0);
+} // END OF mb_per_sec
+
+/* Print the --stats report on stderr: every task in argument order, every worker,
+ * then a summary naming what most likely bounded the run */
+static void print_stats(const struct task *tasks, const struct result_slot *results, int task_cnt,
+                        const struct worker_slot *slots, int worker_cnt, char **filenames,
+                        long long pool_start_ns, long long run_ns){
+   long long busy_sum = 0;
+   long long busy_max = 0;
+   long long cpu_sum = 0;
+   long long bytes_sum = 0;
+   long long startup_sum = 0;
+   int i;
+
+   fprintf(stderr, "mywc_pf: stats: %d tasks, %d workers, %.3f ms wall\n", task_cnt, worker_cnt, run_ns / 1e6);
+   for(i=0; i<task_cnt; i++){
+      const struct task_stats *ts = &results[i].stats;
+      const char *name = filenames ? filenames[tasks[i].file] : "-";
+
+      if(!results[i].done){
+         fprintf(stderr, "mywc_pf: task %d %s: no result\n", i, name);
+         continue;
+      }
+      if(results[i].error){
+         fprintf(stderr, "mywc_pf: task %d %s pid %d: %s\n", i, name, results[i].pid, strerror(results[i].error));
+         continue;
+      }
+      if(tasks[i].len >= 0){
+         fprintf(stderr, "mywc_pf: task %d %s [%lld+%lld]", i, name, (long long)tasks[i].start, (long long)tasks[i].len);
+      }
+      else{
+         fprintf(stderr, "mywc_pf: task %d %s", i, name);
+      }
+      fprintf(stderr, " pid %d: %.3f ms wall, %.3f ms cpu, %lld bytes, %.1f MB/s, %ld major faults\n",
+              results[i].pid, ts->wall_ns / 1e6, ts->cpu_ns / 1e6, ts->bytes,
+              mb_per_sec(ts->bytes, ts->wall_ns), ts->majflt);
+   }
+
+   for(i=0; i<worker_cnt; i++){
+      const struct worker_slot *w = &slots[i];
+      // Time from starting the pool until this worker began its first task
+      long long startup_ns = (w->first_ns ? w->first_ns : w->end_ns) - pool_start_ns;
+
+      fprintf(stderr, "mywc_pf: worker %d pid %d: %d tasks, %lld bytes, %.3f ms busy (%.0f%% utilized), "
+              "%.3f ms cpu, %.3f ms startup, %.1f MB/s, %ld major faults\n",
+              i, w->pid, w->task_cnt, w->bytes, w->busy_ns / 1e6, run_ns > 0 ? 100.0 * w->busy_ns / run_ns : 0.0,
+              w->cpu_ns / 1e6, startup_ns / 1e6, mb_per_sec(w->bytes, w->busy_ns), w->majflt);
+      busy_sum += w->busy_ns;
+      cpu_sum += w->cpu_ns;
+      bytes_sum += w->bytes;
+      startup_sum += startup_ns;
+      if(w->busy_ns > busy_max){
+         busy_max = w->busy_ns;
+      }
+   }
+
+   if(worker_cnt > 0){
+      double busy_mean = (double)busy_sum / worker_cnt;
+      double cpu_share = busy_sum > 0 ? (double)cpu_sum / busy_sum : 0.0;
+      const char *bound;
+
+      if((double)startup_sum / worker_cnt > busy_mean){
+         bound = "fork/startup overhead";
+      }
+      else if(cpu_share >= 0.75){
+         bound = "CPU";
+      }
+      else{
+         bound = "I/O";
+      }
+      fprintf(stderr, "mywc_pf: summary: %lld bytes, %.1f MB/s overall, %.0f%% mean utilization, "
+              "imbalance %.2f (max/mean busy), cpu/busy %.0f%%, likely %s bound\n",
+              bytes_sum, mb_per_sec(bytes_sum, run_ns), run_ns > 0 ? 100.0 * busy_mean / run_ns : 0.0,
+              busy_mean > 0 ? busy_max / busy_mean : 0.0, 100.0 * cpu_share, bound);
+   }
+
+   return;
+} // END OF print_stats
 
 
 int main(int argc, char *argv[]){
@@ -74,271 +435,325 @@ int main(int argc, char *argv[]){
 
    int arg_cnt  = 0;
    int file_cnt = 0;
+   long worker_cnt = sysconf(_SC_NPROCESSORS_ONLN);
+   long long split_size = DEFAULT_SPLIT_SIZE;
+   int range_cnt = 0;
+   int stats_flag = 0;
 
-   int fd[2]; // pipe file descriptor, fd[0] is for reading and fd[1] is for writing
+   int event_fd = eventfd(0, EFD_CLOEXEC); // workers add 1 for every finished task
 
-   if(pipe(fd) == -1){
-      fprintf(stderr, "mywc_pf: %s\n", strerror(errno)); 
+   if(event_fd == -1){
+      fprintf(stderr, "mywc_pf: %s\n", strerror(errno));
       exit(1);
-   }   
+   }
 
-   char **filenames = (argc > 1) ? malloc((argc-1) * sizeof(char*)) : NULL; 
+   char **filenames = (argc > 1) ? malloc((argc-1) * sizeof(char*)) : NULL;
 
    // Process the command line arguments if there are any
    while(--argc){
-      char *argstr = argv[++arg_cnt]; // Point to the current string to process      
+      char *argstr = argv[++arg_cnt]; // Point to the current string to process
 
+      // Check if argstr is a long option
+      if(strcmp(argstr, "--workers") == 0 || strncmp(argstr, "--workers=", 10) == 0){
+         char *value = argstr + 9;
+
+         if(*value == '='){
+            value++;
+         }
+         else if(argc > 1){
+            argc--;
+            value = argv[++arg_cnt];
+         }
+         worker_cnt = atoi(value);
+         if(worker_cnt < 1 || worker_cnt > MAX_WORKERS){
+            printf("mywc_pf: invalid number of workers: '%s'\n", value);
+            return(0);
+         }
+      }
+      else if(strncmp(argstr, "--split-size=", 13) == 0){
+         split_size = parse_size(argstr + 13);
+         if(split_size < 0){
+            printf("mywc_pf: invalid split size: '%s'\n", argstr + 13);
+            return(0);
+         }
+      }
+      else if(strncmp(argstr, "--ranges=", 9) == 0){
+         range_cnt = atoi(argstr + 9);
+         if(range_cnt < 1 || range_cnt > MAX_WORKERS){
+            printf("mywc_pf: invalid number of ranges: '%s'\n", argstr + 9);
+            return(0);
+         }
+      }
+      else if(strcmp(argstr, "--stats") == 0){
+         stats_flag = 1;
+      }
       // Check if argstr is options
-      if(*argstr == '-'){
+      else if(*argstr == '-'){
          while(*(++argstr)){
             switch (*argstr) {
-               case 'c': 
+               case 'c':
                   byte_cnt_flag = 1;
                   break;
-               case 'l': 
+               case 'l':
                   line_cnt_flag = 1;
                   break;
-               case 'w': 
+               case 'w':
                   word_cnt_flag = 1;
                   break;
                default:
                   printf("mywc_pf: invalid option -- '%c'\n", *argstr);
-                  return(0); 
+                  return(0);
             }
          }
       }
-      // Else argstr is a filename so record it so it can be processed later 
+      // Else argstr is a filename so record it so it can be processed later
       else {
-         filenames[file_cnt] = malloc(strlen(argstr) * sizeof(char)); 
+         filenames[file_cnt] = malloc((strlen(argstr) + 1) * sizeof(char));
          strcpy(filenames[file_cnt], argstr);
          file_cnt++;
       }
    }
-   
-   // If at least one option flag was specified
-   if( line_cnt_flag | word_cnt_flag | byte_cnt_flag ){
-      // If at least one file name was specified
-      // Output the values corresponding to the flags followed by the file name and child process id
-      if(file_cnt){
-         int line_total = 0;
-         int word_total = 0;
-         int byte_total = 0;
-
-         int i;
-         for(i=0; i<file_cnt; i++){
-            int flen = strlen(filenames[i]);
-            char *fname = malloc(flen*sizeof(char));
-            strcpy(fname, filenames[i]); 
-
-            pid_t ret_pid = fork();
-
-            if(ret_pid == 0){ // Child Process
-               FILE *fp;
-
-               fp = fopen(filenames[i], "r");
-
-               if(fp == NULL){
-                  fprintf(stderr, "mywc_pf: %s: %s\n", filenames[i], strerror(errno)); 
-                  exit(1);
-               }
-               else{
-                  calculate_file_counts(fp);
-                  fclose(fp);
-
-                  if(write(fd[1], stats_arr, STATSIZE*sizeof(int)) == -1){
-                     fprintf(stderr, "mywc_pf: %s\n", strerror(errno)); 
-                     exit(1);
-                  };
-               }
-               return;
-            }
-            else if(ret_pid > 0){ // Parent Process
-               wait(pid);    
-
-               if(read(fd[0], stats_arr, STATSIZE*sizeof(int)) == -1){
-                  fprintf(stderr, "mywc_pf: %s\n", strerror(errno)); 
-                  exit(1);
-               }
-               if(line_cnt_flag){
-                  line_total += stats_arr[0];
-                  printf("%d ", stats_arr[0]);
-               }
-               if(word_cnt_flag){
-                  word_total += stats_arr[1];
-                  printf("%d ", stats_arr[1]);
-               }
-               if(byte_cnt_flag){
-                  byte_total += stats_arr[2];
-                  printf("%d ", stats_arr[2]);
-               }
-               printf("%s ", fname); 
-               free(fname);
-               printf("%d\n", stats_arr[3]); 
-            }
-            else{ // ERROR
-               fprintf(stderr, "mywc_pf: %s\n", strerror(errno)); 
+
+   if(worker_cnt < 1){
+      worker_cnt = 1;
+   }
+
+   // stat every input up front: sizes drive both the splitting and the dispatch order
+   int file_slots = file_cnt ? file_cnt : 1;
+   off_t *sizes = calloc(file_slots, sizeof(off_t)); // -1 for anything but a regular file
+   long long total_size = 0;
+   int i;
+
+   if(sizes == NULL){
+      fprintf(stderr, "mywc_pf: %s\n", strerror(errno));
+      exit(1);
+   }
+   for(i=0; i<file_slots; i++){
+      struct stat filestat;
+
+      sizes[i] = -1;
+      if(file_cnt && stat(filenames[i], &filestat) == 0 && S_ISREG(filestat.st_mode)){
+         sizes[i] = filestat.st_size;
+         total_size += filestat.st_size;
+      }
+   }
+   long long share = total_size / worker_cnt; // bytes each worker would count in a perfect split
+   int max_ranges = range_cnt ? range_cnt : worker_cnt;
+
+   // Build the task list in argument order. Big regular files are opened here and
+   // split into ranges; the workers inherit the descriptor and pread their range.
+   struct task *tasks = malloc((size_t)file_slots * max_ranges * sizeof(struct task));
+   int *first_task = malloc((file_slots + 1) * sizeof(int)); // file i owns tasks [first_task[i], first_task[i+1])
+   int task_cnt = 0;
+
+   if(tasks == NULL || first_task == NULL){
+      fprintf(stderr, "mywc_pf: %s\n", strerror(errno));
+      exit(1);
+   }
+   for(i=0; i<file_slots; i++){
+      struct stat filestat;
+      int split_fd = -1;
+      int ranges = 1;
+
+      first_task[i] = task_cnt;
+
+      // Split files over the threshold, and files that would on their own outlast a
+      // worker's fair share of the whole run
+      if(split_size > 0 && sizes[i] > 0 &&
+         (sizes[i] >= split_size || (sizes[i] > share && sizes[i] >= MIN_SHARE_SPLIT))){
+         ranges = range_cnt;
+         if(ranges == 0){
+            long long pieces = (share > 0) ? (sizes[i] + share - 1) / share : worker_cnt;
+
+            // At least two pieces, but never more than there are workers (none
+            // at all with a single worker): tasks[] has room for max_ranges per file
+            ranges = (pieces < 2) ? 2 : pieces;
+            if(ranges > max_ranges){
+               ranges = max_ranges;
             }
          }
-         // Output line, word, and byte count totals if more than one file was specified
-         if(file_cnt > 1){
-            if(line_cnt_flag){
-               printf("%d ", line_total);
-            }
-            if(word_cnt_flag){
-               printf("%d ", word_total);
-            }
-            if(byte_cnt_flag){
-               printf("%d ", byte_total);
-            }
-            printf("total\n"); 
+         if(ranges > 1 && sizes[i] >= ranges){
+            split_fd = open(filenames[i], O_RDONLY);
+         }
+      }
+
+      if(split_fd != -1 && fstat(split_fd, &filestat) == 0){
+         int r;
+
+         for(r=0; r<ranges; r++){
+            tasks[task_cnt].file = i;
+            tasks[task_cnt].fd = split_fd;
+            tasks[task_cnt].start = filestat.st_size / ranges * r;
+            tasks[task_cnt].len = (r == ranges - 1) ? filestat.st_size - tasks[task_cnt].start : filestat.st_size / ranges;
+            tasks[task_cnt].size = tasks[task_cnt].len;
+            task_cnt++;
          }
       }
-      // Else no file name so read from STDIN
-      // Output the values corresponding to the flags and the child process id 
       else{
-         pid_t ret_pid = fork();
+         tasks[task_cnt].file = i;
+         tasks[task_cnt].fd = -1;
+         tasks[task_cnt].start = 0;
+         tasks[task_cnt].len = -1;
+         tasks[task_cnt].size = (sizes[i] > 0) ? sizes[i] : 0;
+         task_cnt++;
+      }
+   }
+   first_task[file_slots] = task_cnt;
+   free(sizes);
 
-         if(ret_pid == 0){ // Child Process
-            calculate_file_counts(stdin);
+   // Hand tasks out largest first; output order is still argument order
+   int *order = malloc(task_cnt * sizeof(int));
 
-            if(write(fd[1], stats_arr, STATSIZE*sizeof(int)) == -1){
-               fprintf(stderr, "mywc_pf: %s\n", strerror(errno)); 
-               exit(1);
-            };
+   if(order == NULL){
+      fprintf(stderr, "mywc_pf: %s\n", strerror(errno));
+      exit(1);
+   }
+   for(i=0; i<task_cnt; i++){
+      order[i] = i;
+   }
+   sort_tasks = tasks;
+   qsort(order, task_cnt, sizeof(int), compare_task_size);
 
-            return;
-         }
-         else if(ret_pid > 0){ // Parent Process
-            wait(pid);    
-     
-            if(read(fd[0], stats_arr, STATSIZE*sizeof(int)) == -1){
-               fprintf(stderr, "mywc_pf: %s\n", strerror(errno)); 
-               exit(1);
-            }
-            if(line_cnt_flag){
-               printf("%d ", stats_arr[0]);
-            }
-            if(word_cnt_flag){
-               printf("%d ", stats_arr[1]);
-            }
-            if(byte_cnt_flag){
-               printf("%d ", stats_arr[2]);
-            }
-            printf("%d\n", stats_arr[3]); 
+   // Never start more workers than there are tasks
+   if(worker_cnt > task_cnt){
+      worker_cnt = task_cnt;
+   }
+
+   struct task_queue *queue = mmap(NULL, sizeof(struct task_queue), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   size_t results_len = task_cnt * sizeof(struct result_slot);
+   struct result_slot *results = mmap(NULL, results_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   pid_t *workers = malloc(worker_cnt * sizeof(pid_t));
+   size_t slots_len = stats_flag ? worker_cnt * sizeof(struct worker_slot) : 0;
+   struct worker_slot *slots = stats_flag ? mmap(NULL, slots_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0) : NULL;
+
+   if(queue == MAP_FAILED || results == MAP_FAILED || workers == NULL || slots == MAP_FAILED){
+      fprintf(stderr, "mywc_pf: %s\n", strerror(errno));
+      exit(1);
+   }
+   queue->next = 0;
+   queue->task_cnt = task_cnt;
+   long long pool_start_ns = now_ns();
+
+   // Start the pool. Nothing has been printed yet, so no stdout buffer is inherited.
+   for(i=0; i<worker_cnt; i++){
+      pid_t ret_pid = fork();
+
+      if(ret_pid == 0){ // Child Process
+         run_worker(queue, tasks, order, file_cnt ? filenames : NULL, results, event_fd, slots ? &slots[i] : NULL);
+         _exit(0);
+      }
+      else if(ret_pid > 0){ // Parent Process
+         workers[i] = ret_pid;
+         if(slots != NULL){
+            slots[i].pid = ret_pid;
          }
-         else{ // ERROR
-            fprintf(stderr, "mywc_pf: %s\n", strerror(errno)); 
+      }
+      else{ // ERROR: carry on with the workers already running
+         fprintf(stderr, "mywc_pf: %s\n", strerror(errno));
+         if(i == 0){
+            exit(1);
          }
+         worker_cnt = i;
       }
    }
-   // Else no option flags specified
-   else{
-      // If at least one file name was specified
-      // Output line, word, and byte counts followed by the file name and child process id
-      if(file_cnt){
-         int line_total = 0;
-         int word_total = 0;
-         int byte_total = 0;
-
-         int i;
-         for(i=0; i<file_cnt; i++){
-            int flen = strlen(filenames[i]);
-            char *fname = malloc(flen*sizeof(char));
-            strcpy(fname, filenames[i]); 
-
-            pid_t ret_pid = fork();
-
-            if(ret_pid == 0){ // Child Process
-               FILE *fp;
-               fp = fopen(filenames[i], "r");
-
-               if(fp == NULL){
-                  fprintf(stderr, "mywc_pf: %s: %s\n", filenames[i], strerror(errno)); 
-                  exit(1);
-               }
-               else{
-                  calculate_file_counts(fp);
-                  fclose(fp);
-
-                  if(write(fd[1], stats_arr, STATSIZE*sizeof(int)) == -1){
-                     fprintf(stderr, "mywc_pf: %s\n", strerror(errno)); 
-                     exit(1);
-                  };
-               }
-
-               return;
-            }
-            else if(ret_pid > 0){ // Parent Process
-               wait(pid);    
-     
-               if(read(fd[0], stats_arr, STATSIZE*sizeof(int)) == -1){
-                  fprintf(stderr, "mywc_pf: %s\n", strerror(errno)); 
-                  exit(1);
-               }
-               int i;
-               for(i=0; i<STATSIZE-1; i++){
-                  printf("%d ", stats_arr[i]);
-               }
-               line_total += stats_arr[0];
-               word_total += stats_arr[1];
-               byte_total += stats_arr[2];
-
-               printf("%s ", fname); 
-               free(fname);
-               printf("%d\n", stats_arr[3]); 
-            }
-            else{ // ERROR
-               fprintf(stderr, "mywc_pf: %s\n", strerror(errno)); 
-            }
-         }
-         // Output line, word, and byte count totals if more than one file was specified
-         if(file_cnt > 1){
-            printf("%d ", line_total);
-            printf("%d ", word_total);
-            printf("%d ", byte_total);
-            printf("total\n"); 
-         }
+
+   // Wait for workers to publish results. Each eventfd read returns how many tasks
+   // finished since the last one; the table itself is read without any copying.
+   // Polling with a timeout lets the parent notice a worker that died mid-task.
+   long long totals[3] = {0, 0, 0}; // line, word, and byte totals
+   int next_print = 0;
+   int running = worker_cnt;
+
+   while(next_print < file_slots && running > 0){
+      struct pollfd pfd = {event_fd, POLLIN, 0};
+      unsigned long long finished;
+      int ready = poll(&pfd, 1, REAP_INTERVAL_MS);
+
+      if(ready == -1 && errno != EINTR){
+         fprintf(stderr, "mywc_pf: %s\n", strerror(errno));
+         break;
+      }
+      if(ready > 0 && read(event_fd, &finished, sizeof(finished)) == -1 && errno != EAGAIN && errno != EINTR){
+         fprintf(stderr, "mywc_pf: %s\n", strerror(errno));
+         break;
+      }
+      while(ready == 0 && waitpid(-1, NULL, WNOHANG) > 0){
+         running--;
       }
-      // Else no file name so read from STDIN
-      // Output line, word, and byte counts and child process id
-      else{
-         pid_t ret_pid = fork();
 
-         if(ret_pid == 0){ // Child Process
-            calculate_file_counts(stdin);
+      // Print every file whose turn has come and whose tasks have all finished
+      while(next_print < file_slots){
+         int t;
 
-            if(write(fd[1], stats_arr, STATSIZE*sizeof(int)) == -1){
-               fprintf(stderr, "mywc_pf: %s\n", strerror(errno)); 
-               exit(1);
-            };
-            return;
-         }
-         else if(ret_pid > 0){ // Parent Process
-            wait(pid);    
-     
-            if(read(fd[0], stats_arr, STATSIZE*sizeof(int)) == -1){
-               fprintf(stderr, "mywc_pf: %s\n", strerror(errno)); 
-               exit(1);
-            }
-            int i;
-            for(i=0; i<STATSIZE; i++){
-               printf("\t%d", stats_arr[i]);
+         for(t=first_task[next_print]; t<first_task[next_print + 1]; t++){
+            if(!__atomic_load_n(&results[t].done, __ATOMIC_ACQUIRE)){
+               break;
             }
          }
-         else{ // ERROR
-            fprintf(stderr, "mywc_pf: %s\n", strerror(errno)); 
+         if(t < first_task[next_print + 1]){
+            break;
          }
+         report_file(&results[first_task[next_print]], first_task[next_print + 1] - first_task[next_print],
+                     file_cnt ? filenames[next_print] : NULL, totals, line_cnt_flag, word_cnt_flag, byte_cnt_flag);
+         next_print++;
       }
    }
+   close(event_fd);
+
+   while(waitpid(-1, NULL, 0) > 0){
+   }
+
+   // Anything left is behind a task whose worker died
+   for(; next_print < file_slots; next_print++){
+      report_file(&results[first_task[next_print]], first_task[next_print + 1] - first_task[next_print],
+                  file_cnt ? filenames[next_print] : NULL, totals, line_cnt_flag, word_cnt_flag, byte_cnt_flag);
+   }
+
+   // Output line, word, and byte count totals if more than one file was specified
+   if(file_cnt > 1){
+      int all = !(line_cnt_flag | word_cnt_flag | byte_cnt_flag);
+
+      if(all || line_cnt_flag){
+         printf("%lld ", totals[0]);
+      }
+      if(all || word_cnt_flag){
+         printf("%lld ", totals[1]);
+      }
+      if(all || byte_cnt_flag){
+         printf("%lld ", totals[2]);
+      }
+      printf("total\n");
+   }
+
+   if(stats_flag){
+      // Flush the counts so they come out ahead of the report on a shared terminal
+      fflush(stdout);
+      print_stats(tasks, results, task_cnt, slots, worker_cnt, file_cnt ? filenames : NULL,
+                  pool_start_ns, now_ns() - pool_start_ns);
+   }
 
    // Free pointers
-   int i;
    for(i=0; i<file_cnt; i++){
       free(filenames[i]);
       filenames[i] = NULL;
    }
    free(filenames);
    filenames = NULL;
+   for(i=0; i<task_cnt; i++){
+      // Split files share one descriptor across their ranges; close it once
+      if(tasks[i].fd != -1 && (i == 0 || tasks[i - 1].fd != tasks[i].fd)){
+         close(tasks[i].fd);
+      }
+   }
+   free(tasks);
+   free(first_task);
+   free(order);
+   munmap(results, results_len);
+   free(workers);
+   if(slots != NULL){
+      munmap(slots, slots_len);
+   }
+   munmap(queue, sizeof(struct task_queue));
 
    return(0);
 } // END OF main
@@ -0,0 +1,309 @@
+/*********************************************************
+* FILE NAME: wc_count.c
+*
+* DESCRIPTION: Implementation of the wc_count.h counting library. Bytes are counted
+*              by the widest kernel the CPU supports: AVX2 (32 bytes per step),
+*              SSE2 (16 bytes per step), or a scalar loop, chosen once at runtime.
+*              Each width has a plain kernel for lines/words and a UTF-8 kernel that
+*              also counts characters and line lengths in the same pass.
+*********************************************************/
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "wc_count.h"
+
+typedef void (*count_block_fn)(const unsigned char *, size_t, struct wc_state *);
+
+/* Count lines and words one byte at a time. A word is counted when a word character
+ * is followed by a ' ' or '\n'. */
+static void count_block_scalar(const unsigned char *buf, size_t len, struct wc_state *st){
+   size_t i;
+   int in_word = st->in_word;
+
+   for(i=0; i<len; i++){
+      int sep = (buf[i] == '\n') | (buf[i] == ' ');
+
+      st->counts.lines += (buf[i] == '\n');
+      st->counts.words += sep & in_word;
+      in_word = !sep;
+   }
+   st->in_word = in_word;
+
+   return;
+} // END OF count_block_scalar
+
+#ifdef __SSE2__
+/* Count 16 bytes per step. Bit i of the masks is set when byte i is a newline/separator;
+ * a word ends wherever a separator bit lines up with a word bit shifted in from byte i-1. */
+static void count_block_sse2(const unsigned char *buf, size_t len, struct wc_state *st){
+   const __m128i nl_vec = _mm_set1_epi8('\n');
+   const __m128i sp_vec = _mm_set1_epi8(' ');
+   unsigned int in_word = st->in_word;
+   size_t i = 0;
+
+   for(; i + 16 <= len; i += 16){
+      __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+      unsigned int nl   = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl_vec));
+      unsigned int sep  = nl | _mm_movemask_epi8(_mm_cmpeq_epi8(v, sp_vec));
+      unsigned int word = ~sep & 0xFFFF;
+
+      st->counts.lines += __builtin_popcount(nl);
+      st->counts.words += __builtin_popcount(sep & ((word << 1) | in_word));
+      in_word = word >> 15;
+   }
+   st->in_word = in_word;
+   count_block_scalar(buf + i, len - i, st);
+
+   return;
+} // END OF count_block_sse2
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_AVX2_KERNEL 1
+/* Same as count_block_sse2 but 32 bytes per step. Only called when the CPU reports AVX2. */
+__attribute__((target("avx2")))
+static void count_block_avx2(const unsigned char *buf, size_t len, struct wc_state *st){
+   const __m256i nl_vec = _mm256_set1_epi8('\n');
+   const __m256i sp_vec = _mm256_set1_epi8(' ');
+   unsigned long long in_word = st->in_word;
+   size_t i = 0;
+
+   for(; i + 32 <= len; i += 32){
+      __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+      unsigned int nl   = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl_vec));
+      unsigned int sep  = nl | (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, sp_vec));
+      unsigned int word = ~sep;
+
+      st->counts.lines += __builtin_popcount(nl);
+      st->counts.words += __builtin_popcountll(sep & (((unsigned long long)word << 1) | in_word));
+      in_word = word >> 31;
+   }
+   st->in_word = in_word;
+   count_block_scalar(buf + i, len - i, st);
+
+   return;
+} // END OF count_block_avx2
+#endif
+
+/* Close the current line, which is len characters long */
+static inline void end_line(struct wc_state *st, long long len){
+   if(!st->seen_nl){
+      st->first_line = len;
+      st->seen_nl = 1;
+   }
+   if(len > st->counts.max_line){
+      st->counts.max_line = len;
+   }
+   st->cur_line = 0;
+
+   return;
+} // END OF end_line
+
+/* Add the character starts in the lead mask to the current line, ending a line at
+ * every bit set in the newline mask. Newlines are lead bytes but not part of a line. */
+static inline void count_line_lengths(unsigned int nl, unsigned int lead, struct wc_state *st){
+   while(nl){
+      unsigned int bit = nl & -nl;
+
+      end_line(st, st->cur_line + __builtin_popcount(lead & (bit - 1)));
+      lead &= ~((bit - 1) | bit);
+      nl &= nl - 1;
+   }
+   st->cur_line += __builtin_popcount(lead);
+
+   return;
+} // END OF count_line_lengths
+
+/* count_block_scalar plus UTF-8 characters and line lengths */
+static void count_block_utf8_scalar(const unsigned char *buf, size_t len, struct wc_state *st){
+   size_t i;
+   int in_word = st->in_word;
+
+   for(i=0; i<len; i++){
+      int sep  = (buf[i] == '\n') | (buf[i] == ' ');
+      int lead = (buf[i] & 0xC0) != 0x80;
+
+      st->counts.words += sep & in_word;
+      st->counts.chars += lead;
+      in_word = !sep;
+
+      if(buf[i] == '\n'){
+         st->counts.lines++;
+         end_line(st, st->cur_line);
+      }
+      else{
+         st->cur_line += lead;
+      }
+   }
+   st->in_word = in_word;
+
+   return;
+} // END OF count_block_utf8_scalar
+
+#ifdef __SSE2__
+/* count_block_sse2 plus UTF-8 characters and line lengths. A byte starts a character
+ * unless it is a 10xxxxxx continuation byte. */
+static void count_block_utf8_sse2(const unsigned char *buf, size_t len, struct wc_state *st){
+   const __m128i nl_vec   = _mm_set1_epi8('\n');
+   const __m128i sp_vec   = _mm_set1_epi8(' ');
+   const __m128i top_bits = _mm_set1_epi8((char)0xC0);
+   const __m128i cont_vec = _mm_set1_epi8((char)0x80);
+   unsigned int in_word = st->in_word;
+   size_t i = 0;
+
+   for(; i + 16 <= len; i += 16){
+      __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+      unsigned int nl   = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl_vec));
+      unsigned int sep  = nl | _mm_movemask_epi8(_mm_cmpeq_epi8(v, sp_vec));
+      unsigned int word = ~sep & 0xFFFF;
+      unsigned int lead = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, top_bits), cont_vec)) & 0xFFFF;
+
+      st->counts.lines += __builtin_popcount(nl);
+      st->counts.words += __builtin_popcount(sep & ((word << 1) | in_word));
+      st->counts.chars += __builtin_popcount(lead);
+      count_line_lengths(nl, lead, st);
+      in_word = word >> 15;
+   }
+   st->in_word = in_word;
+   count_block_utf8_scalar(buf + i, len - i, st);
+
+   return;
+} // END OF count_block_utf8_sse2
+#endif
+
+#ifdef HAVE_AVX2_KERNEL
+/* Same as count_block_utf8_sse2 but 32 bytes per step */
+__attribute__((target("avx2")))
+static void count_block_utf8_avx2(const unsigned char *buf, size_t len, struct wc_state *st){
+   const __m256i nl_vec   = _mm256_set1_epi8('\n');
+   const __m256i sp_vec   = _mm256_set1_epi8(' ');
+   const __m256i top_bits = _mm256_set1_epi8((char)0xC0);
+   const __m256i cont_vec = _mm256_set1_epi8((char)0x80);
+   unsigned long long in_word = st->in_word;
+   size_t i = 0;
+
+   for(; i + 32 <= len; i += 32){
+      __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+      unsigned int nl   = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl_vec));
+      unsigned int sep  = nl | (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, sp_vec));
+      unsigned int word = ~sep;
+      unsigned int lead = ~(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(v, top_bits), cont_vec));
+
+      st->counts.lines += __builtin_popcount(nl);
+      st->counts.words += __builtin_popcountll(sep & (((unsigned long long)word << 1) | in_word));
+      st->counts.chars += __builtin_popcount(lead);
+      count_line_lengths(nl, lead, st);
+      in_word = word >> 31;
+   }
+   st->in_word = in_word;
+   count_block_utf8_scalar(buf + i, len - i, st);
+
+   return;
+} // END OF count_block_utf8_avx2
+#endif
+
+/* Pick the widest counting kernel the CPU supports, with or without the UTF-8
+ * counts. The result never changes, so concurrent first calls racing to store it
+ * are harmless. */
+static count_block_fn select_count_block(int utf8){
+   static count_block_fn count_block[2] = {NULL, NULL};
+   count_block_fn fn = __atomic_load_n(&count_block[utf8], __ATOMIC_RELAXED);
+
+   if(fn != NULL){
+      return(fn);
+   }
+#ifdef __SSE2__
+   fn = utf8 ? count_block_utf8_sse2 : count_block_sse2;
+#else
+   fn = utf8 ? count_block_utf8_scalar : count_block_scalar;
+#endif
+#ifdef HAVE_AVX2_KERNEL
+   __builtin_cpu_init();
+   if(__builtin_cpu_supports("avx2")){
+      fn = utf8 ? count_block_utf8_avx2 : count_block_avx2;
+   }
+#endif
+   __atomic_store_n(&count_block[utf8], fn, __ATOMIC_RELAXED);
+
+   return(fn);
+} // END OF select_count_block
+
+void wc_init(struct wc_state *st, unsigned int flags){
+   memset(st, 0, sizeof(*st));
+   st->flags = flags;
+
+   return;
+} // END OF wc_init
+
+void wc_feed(struct wc_state *st, const void *buf, size_t len){
+   const unsigned char *bytes = buf;
+
+   if(len == 0){
+      return;
+   }
+   if(st->counts.bytes == 0){
+      st->first_sep = (bytes[0] == '\n') | (bytes[0] == ' ');
+   }
+   st->counts.bytes += len;
+   select_count_block((st->flags & (WC_CHARS | WC_MAX_LINE)) != 0)(bytes, len, st);
+
+   return;
+} // END OF wc_feed
+
+struct wc_counts wc_finish(const struct wc_state *st){
+   struct wc_counts counts = st->counts;
+
+   // The last line counts even without a '\n' after it
+   if(st->cur_line > counts.max_line){
+      counts.max_line = st->cur_line;
+   }
+
+   return(counts);
+} // END OF wc_finish
+
+void wc_merge(struct wc_state *left, const struct wc_state *right){
+   if(right->counts.bytes == 0){
+      return;
+   }
+   if(left->counts.bytes == 0){
+      *left = *right;
+      return;
+   }
+
+   // A word left open by left ends on the first byte of right
+   if(left->in_word && right->first_sep){
+      left->counts.words++;
+   }
+   left->counts.lines += right->counts.lines;
+   left->counts.words += right->counts.words;
+   left->counts.bytes += right->counts.bytes;
+   left->counts.chars += right->counts.chars;
+   left->in_word = right->in_word;
+
+   // The line left was in continues up to right's first '\n'
+   if(right->seen_nl){
+      long long joined = left->cur_line + right->first_line;
+
+      if(!left->seen_nl){
+         left->first_line = joined;
+         left->seen_nl = 1;
+      }
+      if(joined > left->counts.max_line){
+         left->counts.max_line = joined;
+      }
+      if(right->counts.max_line > left->counts.max_line){
+         left->counts.max_line = right->counts.max_line;
+      }
+      left->cur_line = right->cur_line;
+   }
+   else{
+      left->cur_line += right->cur_line;
+   }
+
+   return;
+} // END OF wc_merge
+
+//END OF FILE
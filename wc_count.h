@@ -0,0 +1,64 @@
+/*********************************************************
+* FILE NAME: wc_count.h
+*
+* DESCRIPTION: Reentrant, incremental line/word/byte counting shared by mywc and
+*              mywc_pf. All state lives in a caller-owned struct wc_state, so any
+*              number of counts can run at once (one per thread, file, or stream)
+*              and buffers are counted in place without being copied.
+*
+*              struct wc_state st;
+*              wc_init(&st, WC_CHARS | WC_MAX_LINE); // or 0 for lines/words/bytes only
+*              wc_feed(&st, buf, len);   // as many times as there is data
+*              counts = wc_finish(&st);
+*
+*              A word is counted when a non-separator byte is followed by a ' ' or
+*              '\n', so a final word with no separator after it is not counted.
+*              Characters are UTF-8 characters (every byte that is not a 10xxxxxx
+*              continuation byte), and line length is measured in characters.
+*********************************************************/
+#ifndef WC_COUNT_H
+#define WC_COUNT_H
+
+#include <stddef.h>
+
+/* Optional counts for wc_init. Lines, words, and bytes are always counted. */
+#define WC_CHARS    0x1 // Count UTF-8 characters
+#define WC_MAX_LINE 0x2 // Track the longest line
+
+/* Totals reported for one input */
+struct wc_counts {
+   long long lines;
+   long long words;
+   long long bytes;
+   long long chars;    // Only with WC_CHARS or WC_MAX_LINE
+   long long max_line; // Only with WC_MAX_LINE
+};
+
+/* Counter state carried from one wc_feed call to the next */
+struct wc_state {
+   struct wc_counts counts;     // counts.max_line only covers lines ended by a '\n'
+   unsigned int flags;          // WC_* flags given to wc_init
+   int in_word;                 // 1 if the last byte fed was part of a word
+   int first_sep;               // 1 if the first byte fed was a separator, used by wc_merge
+   int seen_nl;                 // 1 once a '\n' has been fed
+   long long first_line;        // Characters before the first '\n', used by wc_merge
+   long long cur_line;          // Characters since the last '\n'
+};
+
+/* Reset st to count a new input. flags is a mask of WC_* options. */
+void wc_init(struct wc_state *st, unsigned int flags);
+
+/* Count the next len bytes of the input. buf is only read during the call. */
+void wc_feed(struct wc_state *st, const void *buf, size_t len);
+
+/* Return the totals for everything fed since wc_init */
+struct wc_counts wc_finish(const struct wc_state *st);
+
+/* Append the counts of right, which must have been fed the bytes that directly follow
+ * the bytes fed to left, starting from wc_init. Used to combine byte ranges counted
+ * independently (e.g. by different threads or processes). */
+void wc_merge(struct wc_state *left, const struct wc_state *right);
+
+#endif
+
+//END OF FILE